@@ -45,3 +45,37 @@ bool ReadFile(const char* pFileName, string& outFile) {
 	}
 	return ret;
 }
+
+// Reads a shader source, replacing every line of the form #include "name" with
+// the (recursively expanded) contents of name, looked up next to the including file
+bool ReadShaderFile(const char* pFileName, string& outFile) {
+	string source;
+	if (!ReadFile(pFileName, source)) {
+		return false;
+	}
+
+	string directory = pFileName;
+	size_t slash = directory.find_last_of('/');
+	directory = slash == string::npos ? "" : directory.substr(0, slash + 1);
+
+	// ReadFile terminates every line with '\n'
+	size_t lineStart = 0;
+	while (lineStart < source.size()) {
+		size_t lineEnd = source.find('\n', lineStart);
+		string line = source.substr(lineStart, lineEnd - lineStart + 1);
+		if (line.compare(0, 10, "#include \"") == 0) {
+			size_t nameEnd = line.find('"', 10);
+			string included;
+			if (nameEnd == string::npos ||
+				!ReadShaderFile((directory + line.substr(10, nameEnd - 10)).c_str(), included)) {
+				fprintf(stderr, "Error expanding '%s' in '%s'\n", line.substr(0, line.size() - 1).c_str(), pFileName);
+				return false;
+			}
+			outFile.append(included);
+		} else {
+			outFile.append(line);
+		}
+		lineStart = lineEnd + 1;
+	}
+	return true;
+}
@@ -0,0 +1,169 @@
+#ifndef FRAME_STATS_H
+#define FRAME_STATS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+// Frame time statistics of an interactive session. CPU frame times are the
+// work between FrameStatsBeginFrame and FrameStatsEndFrame measured with a
+// monotonic clock, so waiting for vsync or input does not count; GPU frame
+// times are reported by the caller (see GpuProfiler). Both go into
+// fixed-width histograms that give percentiles over the whole session in
+// constant memory. CPU frames much slower than the recent average are hitches.
+#define FRAME_STATS_BIN_MS 0.25
+#define FRAME_STATS_BIN_COUNT 400      // 0 to 100 ms, slower frames land in the last bin
+#define FRAME_STATS_MAX_HITCHES 256    // hitch events kept for the export
+
+typedef std::chrono::steady_clock FrameClock;
+
+struct FrameHistogram {
+    unsigned int bins[FRAME_STATS_BIN_COUNT];
+    unsigned int count;
+    double sumMs;
+    double maxMs;
+};
+
+struct FrameHitch {
+    unsigned int frame;
+    double ms;
+    double averageMs;   // average frame time before the hitch
+};
+
+struct FrameStats {
+    FrameClock::time_point sessionStart;
+    FrameClock::time_point frameStart;
+    unsigned int frameCount;
+    FrameHistogram cpu;
+    FrameHistogram gpu;
+    double lastCpuMs;
+    double lastGpuMs;
+    double averageMs;      // exponential moving average of the CPU frame time
+    double hitchFactor;    // a hitch is slower than hitchFactor times the average
+    double hitchMinMs;     // and slower than hitchMinMs
+    unsigned int hitchCount;
+    std::vector<FrameHitch> hitches;
+
+    FrameStats() : frameCount(0), lastCpuMs(0.0), lastGpuMs(0.0), averageMs(0.0),
+                   hitchFactor(2.0), hitchMinMs(8.0), hitchCount(0) {
+        memset(&cpu, 0, sizeof(cpu));
+        memset(&gpu, 0, sizeof(gpu));
+        sessionStart = FrameClock::now();
+        frameStart = sessionStart;
+    }
+};
+
+static void FrameHistogramAdd(FrameHistogram& histogram, double ms) {
+    int bin = (int)(ms / FRAME_STATS_BIN_MS);
+    if (bin < 0) bin = 0;
+    if (bin >= FRAME_STATS_BIN_COUNT) bin = FRAME_STATS_BIN_COUNT - 1;
+    histogram.bins[bin]++;
+    histogram.count++;
+    histogram.sumMs += ms;
+    if (ms > histogram.maxMs) histogram.maxMs = ms;
+}
+
+// Frame time below which the fraction p of the frames lie, to the bin width
+static double FrameHistogramPercentile(const FrameHistogram& histogram, double p) {
+    if (histogram.count == 0) return 0.0;
+    unsigned int target = (unsigned int)(p * histogram.count + 0.5);
+    if (target < 1) target = 1;
+    unsigned int seen = 0;
+    for (int i = 0; i < FRAME_STATS_BIN_COUNT; i++) {
+        seen += histogram.bins[i];
+        if (seen >= target) {
+            double upper = (i + 1) * FRAME_STATS_BIN_MS;
+            return upper < histogram.maxMs ? upper : histogram.maxMs;
+        }
+    }
+    return histogram.maxMs;
+}
+
+static double FrameHistogramMean(const FrameHistogram& histogram) {
+    return histogram.count > 0 ? histogram.sumMs / histogram.count : 0.0;
+}
+
+static void FrameStatsBeginFrame(FrameStats& stats) {
+    stats.frameStart = FrameClock::now();
+}
+
+// Records the CPU time since FrameStatsBeginFrame and checks it for a hitch
+static void FrameStatsEndFrame(FrameStats& stats) {
+    double ms = std::chrono::duration<double, std::milli>(FrameClock::now() - stats.frameStart).count();
+    FrameHistogramAdd(stats.cpu, ms);
+    stats.lastCpuMs = ms;
+
+    if (stats.frameCount > 0 && ms > stats.hitchFactor * stats.averageMs && ms > stats.hitchMinMs) {
+        stats.hitchCount++;
+        if (stats.hitches.size() < FRAME_STATS_MAX_HITCHES) {
+            FrameHitch hitch;
+            hitch.frame = stats.frameCount;
+            hitch.ms = ms;
+            hitch.averageMs = stats.averageMs;
+            stats.hitches.push_back(hitch);
+        }
+    }
+    stats.averageMs = stats.frameCount > 0 ? stats.averageMs + 0.05 * (ms - stats.averageMs) : ms;
+    stats.frameCount++;
+}
+
+static void FrameStatsAddGpu(FrameStats& stats, double ms) {
+    FrameHistogramAdd(stats.gpu, ms);
+    stats.lastGpuMs = ms;
+}
+
+// Writes both histograms, one row per non-empty bin
+static bool FrameStatsWriteCsv(const FrameStats& stats, const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "Failed to write frame statistics to %s\n", path);
+        return false;
+    }
+    fprintf(file, "bin_start_ms,bin_end_ms,cpu_frames,gpu_frames\n");
+    for (int i = 0; i < FRAME_STATS_BIN_COUNT; i++) {
+        if (stats.cpu.bins[i] == 0 && stats.gpu.bins[i] == 0) continue;
+        fprintf(file, "%.2f,%.2f,%u,%u\n", i * FRAME_STATS_BIN_MS, (i + 1) * FRAME_STATS_BIN_MS,
+                stats.cpu.bins[i], stats.gpu.bins[i]);
+    }
+    fclose(file);
+    return true;
+}
+
+static void FrameHistogramWriteJson(FILE* file, const char* name, const FrameHistogram& histogram) {
+    fprintf(file, "  \"%s\": { \"frames\": %u, \"mean_ms\": %.3f, \"p50_ms\": %.3f, \"p95_ms\": %.3f, "
+            "\"p99_ms\": %.3f, \"max_ms\": %.3f },\n", name, histogram.count, FrameHistogramMean(histogram),
+            FrameHistogramPercentile(histogram, 0.50), FrameHistogramPercentile(histogram, 0.95),
+            FrameHistogramPercentile(histogram, 0.99), histogram.maxMs);
+}
+
+// Writes the session summary: percentiles of both histograms and the hitches
+static bool FrameStatsWriteJson(const FrameStats& stats, const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "Failed to write frame statistics to %s\n", path);
+        return false;
+    }
+    double seconds = std::chrono::duration<double>(FrameClock::now() - stats.sessionStart).count();
+    fprintf(file, "{\n");
+    fprintf(file, "  \"session_seconds\": %.3f,\n", seconds);
+    fprintf(file, "  \"frames\": %u,\n", stats.frameCount);
+    FrameHistogramWriteJson(file, "cpu", stats.cpu);
+    FrameHistogramWriteJson(file, "gpu", stats.gpu);
+    fprintf(file, "  \"hitches\": {\n");
+    fprintf(file, "    \"count\": %u,\n", stats.hitchCount);
+    fprintf(file, "    \"factor\": %.2f,\n", stats.hitchFactor);
+    fprintf(file, "    \"min_ms\": %.2f,\n", stats.hitchMinMs);
+    fprintf(file, "    \"events\": [");
+    for (size_t i = 0; i < stats.hitches.size(); i++) {
+        fprintf(file, "%s\n      { \"frame\": %u, \"ms\": %.3f, \"average_ms\": %.3f }", i > 0 ? "," : "",
+                stats.hitches[i].frame, stats.hitches[i].ms, stats.hitches[i].averageMs);
+    }
+    fprintf(file, "%s]\n", stats.hitches.empty() ? "" : "\n    ");
+    fprintf(file, "  }\n");
+    fprintf(file, "}\n");
+    fclose(file);
+    return true;
+}
+
+#endif
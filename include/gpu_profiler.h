@@ -0,0 +1,166 @@
+#ifndef GPU_PROFILER_H
+#define GPU_PROFILER_H
+
+#include <GL/glew.h>
+#include <algorithm>
+#include "gpu_timer.h"
+
+// Per-frame GPU profiler built on GL_TIMESTAMP queries. Each section of a
+// frame records a timestamp at its start and end, so sections may contain
+// GpuTimer measurements (GL_TIME_ELAPSED queries cannot nest). Frames use the
+// slots of a ring in turn and are read back GPU_PROFILER_FRAMES frames later,
+// once the driver reports them available, so profiling never stalls the
+// pipeline. A frame whose slot is still in flight is not recorded.
+#define GPU_PROFILER_FRAMES 4
+#define GPU_PROFILER_MAX_SECTIONS 8
+#define GPU_PROFILER_HISTORY 240   // samples kept per section for graphs and statistics
+
+struct GpuProfilerSection {
+    float history[GPU_PROFILER_HISTORY];  // milliseconds, ring ordered by next
+    int count;
+    int next;
+};
+
+struct GpuProfiler {
+    GLuint queries[GPU_PROFILER_FRAMES][GPU_PROFILER_MAX_SECTIONS * 2];
+    bool recorded[GPU_PROFILER_FRAMES][GPU_PROFILER_MAX_SECTIONS];
+    bool pending[GPU_PROFILER_FRAMES];
+    GpuProfilerSection sections[GPU_PROFILER_MAX_SECTIONS];
+    float completedFrameMs[GPU_PROFILER_FRAMES];  // GPU time of the frames read by the last collect
+    int completedFrames;
+    int frame;          // ring slot of the frame being recorded
+    bool recording;     // false when the slot was still in flight
+    bool initialized;
+
+    GpuProfiler() : completedFrames(0), frame(0), recording(false), initialized(false) {
+        for (int f = 0; f < GPU_PROFILER_FRAMES; f++) {
+            pending[f] = false;
+            for (int i = 0; i < GPU_PROFILER_MAX_SECTIONS; i++) {
+                recorded[f][i] = false;
+                queries[f][i * 2] = 0;
+                queries[f][i * 2 + 1] = 0;
+            }
+        }
+        for (int i = 0; i < GPU_PROFILER_MAX_SECTIONS; i++) {
+            sections[i].count = 0;
+            sections[i].next = 0;
+        }
+    }
+};
+
+// Summary of a section's history
+struct GpuProfilerStats {
+    float minMs;
+    float avgMs;
+    float p99Ms;
+    float lastMs;
+};
+
+// Appends a measurement to a section's history
+static void GpuProfilerAddSample(GpuProfilerSection& section, float ms) {
+    section.history[section.next] = ms;
+    section.next = (section.next + 1) % GPU_PROFILER_HISTORY;
+    if (section.count < GPU_PROFILER_HISTORY) section.count++;
+}
+
+// Reads every finished frame in submission order into the section histories.
+// The time from the first section start to the last section end of each
+// frame goes to completedFrameMs.
+static void GpuProfilerCollect(GpuProfiler& profiler) {
+    profiler.completedFrames = 0;
+    if (!profiler.initialized) return;
+    // The slot about to be recorded holds the oldest frame
+    for (int i = 0; i < GPU_PROFILER_FRAMES; i++) {
+        int f = (profiler.frame + i) % GPU_PROFILER_FRAMES;
+        if (!profiler.pending[f]) continue;
+
+        // Queries complete in order, so the last recorded end timestamp tells
+        // whether the whole frame is available
+        int last = -1;
+        for (int s = 0; s < GPU_PROFILER_MAX_SECTIONS; s++) {
+            if (profiler.recorded[f][s]) last = s;
+        }
+        if (last >= 0) {
+            GLint available = 0;
+            glGetQueryObjectiv(profiler.queries[f][last * 2 + 1], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available) break;
+        }
+
+        GLuint64 frameStart = 0, frameEnd = 0;
+        for (int s = 0; s <= last; s++) {
+            if (!profiler.recorded[f][s]) continue;
+            GLuint64 start = 0, end = 0;
+            glGetQueryObjectui64v(profiler.queries[f][s * 2], GL_QUERY_RESULT, &start);
+            glGetQueryObjectui64v(profiler.queries[f][s * 2 + 1], GL_QUERY_RESULT, &end);
+            GpuProfilerAddSample(profiler.sections[s], (float)((end - start) / 1.0e6));
+            if (frameStart == 0 || start < frameStart) frameStart = start;
+            if (end > frameEnd) frameEnd = end;
+        }
+        if (last >= 0) {
+            profiler.completedFrameMs[profiler.completedFrames++] = (float)((frameEnd - frameStart) / 1.0e6);
+        }
+        profiler.pending[f] = false;
+    }
+}
+
+// Starts a frame: collects the finished frames and claims the next ring slot
+static void GpuProfilerBeginFrame(GpuProfiler& profiler) {
+    profiler.recording = false;
+    if (!GpuTimerSupported()) return;
+    if (!profiler.initialized) {
+        glGenQueries(GPU_PROFILER_FRAMES * GPU_PROFILER_MAX_SECTIONS * 2, &profiler.queries[0][0]);
+        profiler.initialized = true;
+    }
+    GpuProfilerCollect(profiler);
+    if (profiler.pending[profiler.frame]) return;
+    for (int s = 0; s < GPU_PROFILER_MAX_SECTIONS; s++) {
+        profiler.recorded[profiler.frame][s] = false;
+    }
+    profiler.recording = true;
+}
+
+static void GpuProfilerBeginSection(GpuProfiler& profiler, int section) {
+    if (!profiler.recording) return;
+    glQueryCounter(profiler.queries[profiler.frame][section * 2], GL_TIMESTAMP);
+}
+
+static void GpuProfilerEndSection(GpuProfiler& profiler, int section) {
+    if (!profiler.recording) return;
+    glQueryCounter(profiler.queries[profiler.frame][section * 2 + 1], GL_TIMESTAMP);
+    profiler.recorded[profiler.frame][section] = true;
+}
+
+// Ends the frame; its results are read by a later GpuProfilerBeginFrame
+static void GpuProfilerEndFrame(GpuProfiler& profiler) {
+    if (!profiler.recording) return;
+    profiler.pending[profiler.frame] = true;
+    profiler.frame = (profiler.frame + 1) % GPU_PROFILER_FRAMES;
+    profiler.recording = false;
+}
+
+// Minimum, average and 99th percentile of a section's history. Returns false
+// when the section has no samples yet.
+static bool GpuProfilerSectionStats(const GpuProfilerSection& section, GpuProfilerStats& stats) {
+    if (section.count == 0) return false;
+    float sorted[GPU_PROFILER_HISTORY];
+    double sum = 0.0;
+    for (int i = 0; i < section.count; i++) {
+        sorted[i] = section.history[i];
+        sum += section.history[i];
+    }
+    std::sort(sorted, sorted + section.count);
+    stats.minMs = sorted[0];
+    stats.avgMs = (float)(sum / section.count);
+    stats.p99Ms = sorted[std::min(section.count - 1, (int)(0.99f * section.count))];
+    stats.lastMs = section.history[(section.next + GPU_PROFILER_HISTORY - 1) % GPU_PROFILER_HISTORY];
+    return true;
+}
+
+static void GpuProfilerRelease(GpuProfiler& profiler) {
+    if (profiler.initialized) {
+        glDeleteQueries(GPU_PROFILER_FRAMES * GPU_PROFILER_MAX_SECTIONS * 2, &profiler.queries[0][0]);
+        profiler.initialized = false;
+    }
+}
+
+#endif
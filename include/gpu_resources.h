@@ -0,0 +1,330 @@
+#ifndef GPU_RESOURCES_H
+#define GPU_RESOURCES_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <map>
+#include <string>
+#include <GL/glew.h>
+
+// Central owner of all OpenGL objects created by the demo. Resources are
+// looked up by name so that re-initialisation paths (model reload, scene
+// reset) reuse the existing object and only reallocate storage when its
+// size or format changes. Allocated bytes are tracked per category and
+// checked against a configurable budget.
+
+enum GpuResourceCategory {
+    GPU_RESOURCE_BUFFER = 0,
+    GPU_RESOURCE_TEXTURE,
+    GPU_RESOURCE_VERTEX_ARRAY,
+    GPU_RESOURCE_FRAMEBUFFER,
+    GPU_RESOURCE_PROGRAM,
+    GPU_RESOURCE_CATEGORY_COUNT
+};
+
+static const char* gpuResourceCategoryNames[GPU_RESOURCE_CATEGORY_COUNT] = {
+    "Buffers", "Textures", "Vertex Arrays", "Framebuffers", "Programs"
+};
+
+struct GpuResource {
+    GLuint id;
+    GpuResourceCategory category;
+    size_t bytes;
+    // Storage description used to decide between reuse and reallocation
+    GLenum internalFormat;
+    int width, height, depth;
+};
+
+struct GpuResourceManager {
+    std::map<std::string, GpuResource> resources;
+    size_t categoryBytes[GPU_RESOURCE_CATEGORY_COUNT];
+    int categoryCount[GPU_RESOURCE_CATEGORY_COUNT];
+    size_t budgetBytes;
+    bool overBudget;
+
+    GpuResourceManager() : budgetBytes(512u * 1024u * 1024u), overBudget(false) {
+        for (int i = 0; i < GPU_RESOURCE_CATEGORY_COUNT; i++) {
+            categoryBytes[i] = 0;
+            categoryCount[i] = 0;
+        }
+    }
+};
+
+static GpuResourceManager gpuResources;
+
+// Size in bytes of a single texel of the given internal format
+static size_t GpuBytesPerTexel(GLenum internalFormat) {
+    switch (internalFormat) {
+    case GL_R8:                 return 1;
+    case GL_RG8:
+    case GL_R16F:               return 2;
+    case GL_RGB8:               return 3;
+    case GL_RGBA8:
+    case GL_R32F:
+    case GL_R32UI:
+    case GL_RG16F:
+    case GL_DEPTH_COMPONENT24:
+    case GL_DEPTH_COMPONENT32F:
+    case GL_DEPTH24_STENCIL8:   return 4;
+    case GL_RGB16F:             return 6;
+    case GL_RG32F:
+    case GL_RGBA16F:            return 8;
+    case GL_RGB32F:             return 12;
+    case GL_RGBA32F:
+    case GL_RGBA32UI:           return 16;
+    default:                    return 4;
+    }
+}
+
+static size_t GpuTotalBytes() {
+    size_t total = 0;
+    for (int i = 0; i < GPU_RESOURCE_CATEGORY_COUNT; i++) {
+        total += gpuResources.categoryBytes[i];
+    }
+    return total;
+}
+
+static void GpuCheckBudget() {
+    size_t total = GpuTotalBytes();
+    bool over = total > gpuResources.budgetBytes;
+    if (over && !gpuResources.overBudget) {
+        fprintf(stderr, "Warning: GPU memory use %.1f MB exceeds budget of %.1f MB\n",
+                total / (1024.0 * 1024.0), gpuResources.budgetBytes / (1024.0 * 1024.0));
+    }
+    gpuResources.overBudget = over;
+}
+
+static void GpuSetMemoryBudget(size_t bytes) {
+    gpuResources.budgetBytes = bytes;
+    gpuResources.overBudget = false;
+    GpuCheckBudget();
+}
+
+static void GpuSetResourceBytes(GpuResource& res, size_t bytes) {
+    gpuResources.categoryBytes[res.category] -= res.bytes;
+    res.bytes = bytes;
+    gpuResources.categoryBytes[res.category] += bytes;
+    GpuCheckBudget();
+}
+
+// Returns the resource registered under name, creating the GL object on first use
+static GpuResource& GpuAcquire(const char* name, GpuResourceCategory category) {
+    std::map<std::string, GpuResource>::iterator it = gpuResources.resources.find(name);
+    if (it != gpuResources.resources.end()) {
+        if (it->second.category != category) {
+            fprintf(stderr, "GPU resource '%s' requested with a different category\n", name);
+            exit(1);
+        }
+        return it->second;
+    }
+
+    GpuResource res;
+    res.id = 0;
+    res.category = category;
+    res.bytes = 0;
+    res.internalFormat = 0;
+    res.width = res.height = res.depth = 0;
+
+    switch (category) {
+    case GPU_RESOURCE_BUFFER:       glGenBuffers(1, &res.id); break;
+    case GPU_RESOURCE_TEXTURE:      glGenTextures(1, &res.id); break;
+    case GPU_RESOURCE_VERTEX_ARRAY: glGenVertexArrays(1, &res.id); break;
+    case GPU_RESOURCE_FRAMEBUFFER:  glGenFramebuffers(1, &res.id); break;
+    case GPU_RESOURCE_PROGRAM:      break; // Programs are created by the shader code and adopted
+    default: break;
+    }
+
+    gpuResources.categoryCount[category]++;
+    return gpuResources.resources[name] = res;
+}
+
+// Lookups of a named object, creating it on first use. Inline so that
+// translation units which do not use every kind compile without warnings.
+static inline GLuint GpuBuffer(const char* name) {
+    return GpuAcquire(name, GPU_RESOURCE_BUFFER).id;
+}
+
+static inline GLuint GpuTexture(const char* name) {
+    return GpuAcquire(name, GPU_RESOURCE_TEXTURE).id;
+}
+
+static inline GLuint GpuVertexArray(const char* name) {
+    return GpuAcquire(name, GPU_RESOURCE_VERTEX_ARRAY).id;
+}
+
+static inline GLuint GpuFramebuffer(const char* name) {
+    return GpuAcquire(name, GPU_RESOURCE_FRAMEBUFFER).id;
+}
+
+// Binds the named buffer to target and uploads data, reusing the existing
+// storage when the size is unchanged
+static GLuint GpuBufferData(const char* name, GLenum target, size_t size, const void* data, GLenum usage) {
+    GpuResource& res = GpuAcquire(name, GPU_RESOURCE_BUFFER);
+    glBindBuffer(target, res.id);
+    if (res.bytes == size && res.internalFormat == usage) {
+        if (data) glBufferSubData(target, 0, size, data);
+    } else {
+        glBufferData(target, size, data, usage);
+        res.internalFormat = usage;
+        GpuSetResourceBytes(res, size);
+    }
+    return res.id;
+}
+
+// Binds the named 2D texture and (re)allocates its storage only if the size or
+// format changed. Data, if given, is uploaded in either case.
+static GLuint GpuTexImage2D(const char* name, GLenum internalFormat, int width, int height,
+                            GLenum format, GLenum type, const void* data) {
+    GpuResource& res = GpuAcquire(name, GPU_RESOURCE_TEXTURE);
+    glBindTexture(GL_TEXTURE_2D, res.id);
+    if (res.internalFormat == internalFormat && res.width == width && res.height == height) {
+        if (data) glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, format, type, data);
+    } else {
+        glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, data);
+        res.internalFormat = internalFormat;
+        res.width = width;
+        res.height = height;
+        res.depth = 1;
+        GpuSetResourceBytes(res, GpuBytesPerTexel(internalFormat) * width * height);
+    }
+    return res.id;
+}
+
+// Binds the named layered texture (GL_TEXTURE_2D_ARRAY or GL_TEXTURE_3D) to
+// target and (re)allocates its storage only if the size or format changed.
+// Returns true if the storage was reallocated.
+static bool GpuTexImage3D(const char* name, GLenum target, GLenum internalFormat, int width, int height,
+                          int depth, GLenum format, GLenum type, GLuint* texture) {
+    GpuResource& res = GpuAcquire(name, GPU_RESOURCE_TEXTURE);
+    glBindTexture(target, res.id);
+    *texture = res.id;
+    if (res.internalFormat == internalFormat && res.width == width && res.height == height && res.depth == depth) {
+        return false;
+    }
+    glTexImage3D(target, 0, internalFormat, width, height, depth, 0, format, type, NULL);
+    res.internalFormat = internalFormat;
+    res.width = width;
+    res.height = height;
+    res.depth = depth;
+    GpuSetResourceBytes(res, GpuBytesPerTexel(internalFormat) * width * height * depth);
+    return true;
+}
+
+// Hands ownership of a linked program to the manager. A previously registered
+// program with the same name is deleted.
+static GLuint GpuAdoptProgram(const char* name, GLuint program) {
+    GpuResource& res = GpuAcquire(name, GPU_RESOURCE_PROGRAM);
+    if (res.id != 0 && res.id != program) {
+        glDeleteProgram(res.id);
+    }
+    res.id = program;
+    return program;
+}
+
+static void GpuDeleteObject(const GpuResource& res) {
+    switch (res.category) {
+    case GPU_RESOURCE_BUFFER:       glDeleteBuffers(1, &res.id); break;
+    case GPU_RESOURCE_TEXTURE:      glDeleteTextures(1, &res.id); break;
+    case GPU_RESOURCE_VERTEX_ARRAY: glDeleteVertexArrays(1, &res.id); break;
+    case GPU_RESOURCE_FRAMEBUFFER:  glDeleteFramebuffers(1, &res.id); break;
+    case GPU_RESOURCE_PROGRAM:      glDeleteProgram(res.id); break;
+    default: break;
+    }
+}
+
+// Deletes the named resource if it exists
+static void GpuRelease(const char* name) {
+    std::map<std::string, GpuResource>::iterator it = gpuResources.resources.find(name);
+    if (it == gpuResources.resources.end()) return;
+
+    GpuDeleteObject(it->second);
+    gpuResources.categoryBytes[it->second.category] -= it->second.bytes;
+    gpuResources.categoryCount[it->second.category]--;
+    gpuResources.resources.erase(it);
+}
+
+#define GPU_MAX_COLOR_ATTACHMENTS 8   // GL_MAX_DRAW_BUFFERS is at least 8 in GL 3.3
+
+// Name of color attachment index of the render target name
+static std::string GpuRenderTargetTextureName(const char* name, int index) {
+    std::string textureName = std::string(name) + ":color";
+    if (index > 0) textureName += (char)('0' + index);
+    return textureName;
+}
+
+// Framebuffer named name with count color textures of the given formats and
+// size, attached in order and all enabled as draw buffers. A GL_NONE format
+// leaves that attachment empty, so fragment outputs at that location are
+// dropped. The FBO is left bound. Returns true when texture storage was
+// (re)allocated, in which case the previous contents are lost.
+static bool GpuRenderTargets(const char* name, int count, const GLenum* internalFormats,
+                             int width, int height, GLuint* textures) {
+    bool reallocated = false;
+    for (int i = 0; i < count; i++) {
+        textures[i] = 0;
+        if (internalFormats[i] == GL_NONE) continue;
+        std::string textureName = GpuRenderTargetTextureName(name, i);
+        GpuResource& tex = GpuAcquire(textureName.c_str(), GPU_RESOURCE_TEXTURE);
+        bool resized = tex.internalFormat != internalFormats[i] || tex.width != width || tex.height != height;
+
+        textures[i] = GpuTexImage2D(textureName.c_str(), internalFormats[i], width, height, GL_RGBA, GL_FLOAT, NULL);
+        if (resized) {
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        }
+        reallocated |= resized;
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    GLuint fbo = GpuFramebuffer(name);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    if (reallocated) {
+        GLenum drawBuffers[GPU_MAX_COLOR_ATTACHMENTS];
+        for (int i = 0; i < count; i++) {
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, textures[i], 0);
+            drawBuffers[i] = textures[i] != 0 ? GL_COLOR_ATTACHMENT0 + i : GL_NONE;
+        }
+        glDrawBuffers(count, drawBuffers);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            fprintf(stderr, "Render target '%s' is incomplete\n", name);
+        }
+    }
+    return reallocated;
+}
+
+// Framebuffer with a single color texture, see GpuRenderTargets
+static bool GpuRenderTarget(const char* name, GLenum internalFormat, int width, int height, GLuint* texture) {
+    return GpuRenderTargets(name, 1, &internalFormat, width, height, texture);
+}
+
+// Releases a target created with GpuRenderTarget or GpuRenderTargets
+static void GpuReleaseRenderTarget(const char* name) {
+    GpuRelease(name);
+    for (int i = 0; i < GPU_MAX_COLOR_ATTACHMENTS; i++) {
+        GpuRelease(GpuRenderTargetTextureName(name, i).c_str());
+    }
+}
+
+// Called once the owners have released their resources. Anything still
+// registered is reported as a leak and deleted.
+static int GpuShutdown() {
+    int leaks = 0;
+    std::map<std::string, GpuResource>::iterator it;
+    for (it = gpuResources.resources.begin(); it != gpuResources.resources.end(); ++it) {
+        fprintf(stderr, "GPU resource leak: %s '%s' (id %u, %zu bytes)\n",
+                gpuResourceCategoryNames[it->second.category], it->first.c_str(),
+                it->second.id, it->second.bytes);
+        GpuDeleteObject(it->second);
+        leaks++;
+    }
+    gpuResources.resources.clear();
+    for (int i = 0; i < GPU_RESOURCE_CATEGORY_COUNT; i++) {
+        gpuResources.categoryBytes[i] = 0;
+        gpuResources.categoryCount[i] = 0;
+    }
+    return leaks;
+}
+
+#endif
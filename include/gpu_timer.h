@@ -0,0 +1,93 @@
+#ifndef GPU_TIMER_H
+#define GPU_TIMER_H
+
+#include <GL/glew.h>
+
+// Non-blocking GPU timer built on GL_TIME_ELAPSED queries. Each Begin/End pair
+// uses the next query of a small ring, and results are only read once the
+// driver reports them available, so timing never stalls the pipeline.
+#define GPU_TIMER_QUERY_COUNT 4
+
+struct GpuTimer {
+    GLuint queries[GPU_TIMER_QUERY_COUNT];
+    bool pending[GPU_TIMER_QUERY_COUNT];
+    double work[GPU_TIMER_QUERY_COUNT];
+    int next;
+    double lastMs;        // most recent completed measurement
+    double lastWork;      // amount of work the caller reported for it
+    bool initialized;
+
+    GpuTimer() : next(0), lastMs(0.0), lastWork(0.0), initialized(false) {
+        for (int i = 0; i < GPU_TIMER_QUERY_COUNT; i++) {
+            queries[i] = 0;
+            pending[i] = false;
+            work[i] = 0.0;
+        }
+    }
+};
+
+static bool GpuTimerSupported() {
+    return GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
+}
+
+// Starts timing the commands issued until GpuTimerEnd. Returns false when no
+// query is free because the ring is still waiting on the GPU.
+static bool GpuTimerBegin(GpuTimer& timer) {
+    if (!GpuTimerSupported()) return false;
+    if (!timer.initialized) {
+        glGenQueries(GPU_TIMER_QUERY_COUNT, timer.queries);
+        timer.initialized = true;
+    }
+    if (timer.pending[timer.next]) return false;
+    glBeginQuery(GL_TIME_ELAPSED, timer.queries[timer.next]);
+    return true;
+}
+
+// Ends the measurement. work is an arbitrary amount (e.g. tiles drawn) that is
+// reported back with the result, so callers can derive a cost per unit.
+static void GpuTimerEnd(GpuTimer& timer, double work = 1.0) {
+    glEndQuery(GL_TIME_ELAPSED);
+    timer.pending[timer.next] = true;
+    timer.work[timer.next] = work;
+    timer.next = (timer.next + 1) % GPU_TIMER_QUERY_COUNT;
+}
+
+// Reads every finished query in submission order. Returns true if lastMs was updated.
+static bool GpuTimerCollect(GpuTimer& timer) {
+    if (!timer.initialized) return false;
+    bool updated = false;
+    for (int i = 0; i < GPU_TIMER_QUERY_COUNT; i++) {
+        int index = (timer.next + i) % GPU_TIMER_QUERY_COUNT;
+        if (!timer.pending[index]) continue;
+
+        GLint available = 0;
+        glGetQueryObjectiv(timer.queries[index], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) break;
+
+        GLuint64 elapsed = 0;
+        glGetQueryObjectui64v(timer.queries[index], GL_QUERY_RESULT, &elapsed);
+        timer.lastMs = elapsed / 1.0e6;
+        timer.lastWork = timer.work[index];
+        timer.pending[index] = false;
+        updated = true;
+    }
+    return updated;
+}
+
+// Drops every measurement still in flight, for callers whose work changes
+// meaning (e.g. a different frame mode) so stale results are never reported.
+static void GpuTimerDiscard(GpuTimer& timer) {
+    for (int i = 0; i < GPU_TIMER_QUERY_COUNT; i++) {
+        timer.pending[i] = false;
+    }
+    timer.lastWork = 0.0;
+}
+
+static void GpuTimerRelease(GpuTimer& timer) {
+    if (timer.initialized) {
+        glDeleteQueries(GPU_TIMER_QUERY_COUNT, timer.queries);
+        timer.initialized = false;
+    }
+}
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef LIGHT_TREE_H
+#define LIGHT_TREE_H
+
+#include <vector>
+#include <algorithm>
+#include <glm/glm.hpp>
+
+// Node of the binary light hierarchy used to pick lights by importance. The
+// layout is three RGBA32F texels per node, as read by rt_common.glsl.
+struct LightTreeNode {
+    glm::vec3 boundsMin;
+    float energy;        // summed power of the lights below the node
+    glm::vec3 boundsMax;
+    float range;         // largest light range below the node, 0 if any is unbounded
+    float left;          // child node indices, stored as floats for the texture
+    float right;
+    float light;         // light index for leaves, -1 for inner nodes
+    float pad2;
+};
+
+// A light as seen by the tree builder
+struct LightTreeItem {
+    glm::vec3 boundsMin;
+    glm::vec3 boundsMax;
+    float energy;
+    float range;         // distance at which the light fades out, 0 for unbounded
+    int index;
+};
+
+// Builds the subtree over items[begin, end) and returns its node index. Items
+// are split at the median along the widest axis of their centers, which keeps
+// the tree balanced so a descent takes log2(lights) steps.
+static int BuildLightTreeNode(std::vector<LightTreeItem>& items, int begin, int end,
+                              std::vector<LightTreeNode>& nodes) {
+    int nodeIndex = (int)nodes.size();
+    nodes.push_back(LightTreeNode());
+
+    LightTreeNode node = LightTreeNode();
+    node.boundsMin = items[begin].boundsMin;
+    node.boundsMax = items[begin].boundsMax;
+    glm::vec3 centerMin = 0.5f * (items[begin].boundsMin + items[begin].boundsMax);
+    glm::vec3 centerMax = centerMin;
+    bool unbounded = false;
+    for (int i = begin; i < end; i++) {
+        glm::vec3 center = 0.5f * (items[i].boundsMin + items[i].boundsMax);
+        node.boundsMin = glm::min(node.boundsMin, items[i].boundsMin);
+        node.boundsMax = glm::max(node.boundsMax, items[i].boundsMax);
+        centerMin = glm::min(centerMin, center);
+        centerMax = glm::max(centerMax, center);
+        node.energy += items[i].energy;
+        node.range = std::max(node.range, items[i].range);
+        unbounded |= items[i].range <= 0.0f;
+    }
+    if (unbounded) {
+        node.range = 0.0f;
+    }
+
+    if (end - begin == 1) {
+        node.left = -1.0f;
+        node.right = -1.0f;
+        node.light = (float)items[begin].index;
+    } else {
+        glm::vec3 extent = centerMax - centerMin;
+        int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        int middle = (begin + end) / 2;
+        std::nth_element(items.begin() + begin, items.begin() + middle, items.begin() + end,
+                         [axis](const LightTreeItem& a, const LightTreeItem& b) {
+                             return a.boundsMin[axis] + a.boundsMax[axis] < b.boundsMin[axis] + b.boundsMax[axis];
+                         });
+        node.left = (float)BuildLightTreeNode(items, begin, middle, nodes);
+        node.right = (float)BuildLightTreeNode(items, middle, end, nodes);
+        node.light = -1.0f;
+    }
+
+    nodes[nodeIndex] = node;
+    return nodeIndex;
+}
+
+// Builds the light hierarchy with the root at index 0. Leaves hold one light each.
+static void BuildLightTree(std::vector<LightTreeItem> items, std::vector<LightTreeNode>& nodes) {
+    nodes.clear();
+    if (items.empty()) return;
+    nodes.reserve(items.size() * 2 - 1);
+    BuildLightTreeNode(items, 0, (int)items.size(), nodes);
+}
+
+#endif
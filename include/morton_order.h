@@ -0,0 +1,89 @@
+#ifndef MORTON_ORDER_H
+#define MORTON_ORDER_H
+
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <utility>
+#include <glm/glm.hpp>
+
+// Spread the lower 10 bits of v so that there are two zero bits between each bit
+static unsigned int ExpandBits10(unsigned int v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// 30-bit Morton code for a point whose coordinates are in [0, 1]
+static unsigned int MortonCode3D(glm::vec3 p) {
+    p = glm::clamp(p * 1024.0f, glm::vec3(0.0f), glm::vec3(1023.0f));
+    unsigned int xx = ExpandBits10((unsigned int)p.x);
+    unsigned int yy = ExpandBits10((unsigned int)p.y);
+    unsigned int zz = ExpandBits10((unsigned int)p.z);
+    return (xx << 2) | (yy << 1) | zz;
+}
+
+// Number of worker threads used by the parallel passes below
+static int MortonWorkerCount(size_t count) {
+    int workers = (int)std::thread::hardware_concurrency();
+    if (workers < 1) workers = 1;
+    // Not worth spawning threads for small meshes
+    int maxByWork = (int)(count / 4096) + 1;
+    return workers < maxByWork ? workers : maxByWork;
+}
+
+// Computes the permutation that sorts the given points along a Morton curve
+// over their bounding box. order[i] is the index of the i-th point on the curve.
+static void ComputeMortonOrder(const std::vector<glm::vec3>& points, std::vector<unsigned int>& order) {
+    size_t count = points.size();
+    order.resize(count);
+    if (count == 0) return;
+
+    // Bounds of the points, used to normalize them into the unit cube
+    glm::vec3 boundsMin = points[0];
+    glm::vec3 boundsMax = points[0];
+    for (size_t i = 1; i < count; i++) {
+        boundsMin = glm::min(boundsMin, points[i]);
+        boundsMax = glm::max(boundsMax, points[i]);
+    }
+    glm::vec3 extent = glm::max(boundsMax - boundsMin, glm::vec3(1e-6f));
+
+    int workers = MortonWorkerCount(count);
+    size_t chunk = (count + workers - 1) / workers;
+
+    // Each worker computes the codes of its chunk and sorts it
+    std::vector<std::pair<unsigned int, unsigned int> > keys(count);
+    std::vector<std::thread> threads;
+    for (int w = 0; w < workers; w++) {
+        size_t begin = w * chunk;
+        size_t end = std::min(count, begin + chunk);
+        if (begin >= end) break;
+        threads.push_back(std::thread([&points, &keys, boundsMin, extent, begin, end]() {
+            for (size_t i = begin; i < end; i++) {
+                keys[i].first = MortonCode3D((points[i] - boundsMin) / extent);
+                keys[i].second = (unsigned int)i;
+            }
+            std::sort(keys.begin() + begin, keys.begin() + end);
+        }));
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+
+    // Merge the sorted chunks pairwise
+    for (size_t width = chunk; width < count; width *= 2) {
+        for (size_t begin = 0; begin + width < count; begin += 2 * width) {
+            size_t middle = begin + width;
+            size_t end = std::min(count, begin + 2 * width);
+            std::inplace_merge(keys.begin() + begin, keys.begin() + middle, keys.begin() + end);
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        order[i] = keys[i].second;
+    }
+}
+
+#endif
@@ -0,0 +1,128 @@
+#ifndef SHADER_CACHE_H
+#define SHADER_CACHE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <GL/glew.h>
+
+// On-disk cache of linked program binaries. Entries are keyed by a hash of the
+// complete shader sources (including any injected #defines) and the driver
+// identification strings, so a driver update or a shader edit is a cache miss.
+
+static const char* shaderCacheDirectory = "shader_cache";
+static int shaderCacheHits = 0;
+static int shaderCacheMisses = 0;
+
+// 64-bit FNV-1a hash
+static unsigned long long HashBytes(const void* data, size_t size, unsigned long long hash = 14695981039346656037ULL) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static bool ShaderCacheSupported() {
+    if (!GLEW_VERSION_4_1 && !GLEW_ARB_get_program_binary) return false;
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    return formats > 0;
+}
+
+// Key identifying a program built from the given sources on the current driver
+static std::string ShaderCacheKey(const std::string& vs, const std::string& fs) {
+    unsigned long long hash = HashBytes(vs.data(), vs.size());
+    hash = HashBytes("\0", 1, hash);
+    hash = HashBytes(fs.data(), fs.size(), hash);
+
+    GLenum driverStrings[3] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+    for (int i = 0; i < 3; i++) {
+        const char* str = (const char*)glGetString(driverStrings[i]);
+        if (str) hash = HashBytes(str, strlen(str), hash);
+    }
+
+    char key[32];
+    snprintf(key, sizeof(key), "%016llx", hash);
+    return key;
+}
+
+static std::string ShaderCachePath(const std::string& key) {
+    return std::string(shaderCacheDirectory) + "/" + key + ".bin";
+}
+
+// Loads the cached binary for key into program. Returns false on a miss or if
+// the driver rejects the binary, in which case the program must be built from source.
+static bool ShaderCacheLoad(GLuint program, const std::string& key) {
+    if (!ShaderCacheSupported()) return false;
+
+    FILE* file = fopen(ShaderCachePath(key).c_str(), "rb");
+    if (!file) {
+        shaderCacheMisses++;
+        return false;
+    }
+
+    GLenum format = 0;
+    std::vector<char> binary;
+    bool ok = fread(&format, sizeof(format), 1, file) == 1;
+    if (ok) {
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file) - (long)sizeof(format);
+        fseek(file, sizeof(format), SEEK_SET);
+        ok = size > 0;
+        if (ok) {
+            binary.resize(size);
+            ok = fread(&binary[0], 1, size, file) == (size_t)size;
+        }
+    }
+    fclose(file);
+
+    if (ok) {
+        glProgramBinary(program, format, &binary[0], (GLsizei)binary.size());
+        GLint success = 0;
+        glGetProgramiv(program, GL_LINK_STATUS, &success);
+        ok = success != 0;
+    }
+
+    if (ok) {
+        shaderCacheHits++;
+    } else {
+        shaderCacheMisses++;
+    }
+    return ok;
+}
+
+// Must be called before linking a program that will be stored in the cache
+static void ShaderCachePrepare(GLuint program) {
+    if (ShaderCacheSupported()) {
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+}
+
+// Writes the binary of a successfully linked program to the cache
+static void ShaderCacheStore(GLuint program, const std::string& key) {
+    if (!ShaderCacheSupported()) return;
+
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) return;
+
+    std::vector<char> binary(length);
+    GLenum format = 0;
+    glGetProgramBinary(program, length, NULL, &format, &binary[0]);
+
+    mkdir(shaderCacheDirectory, 0755);
+    FILE* file = fopen(ShaderCachePath(key).c_str(), "wb");
+    if (!file) {
+        fprintf(stderr, "Could not write shader cache entry '%s'\n", ShaderCachePath(key).c_str());
+        return;
+    }
+    fwrite(&format, sizeof(format), 1, file);
+    fwrite(&binary[0], 1, binary.size(), file);
+    fclose(file);
+}
+
+#endif
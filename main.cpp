@@ -4,6 +4,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
@@ -17,6 +20,17 @@
 #include "file_utils.h"
 #include "math_utils.h"
 #include "OFFReader.h"
+#include "morton_order.h"
+#include "gpu_resources.h"
+#include "shader_cache.h"
+#include "gpu_timer.h"
+#include "gpu_profiler.h"
+#include "frame_stats.h"
+#ifdef __linux__
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+#include "light_tree.h"
 #define GL_SILENCE_DEPRECATION
 
 /********************************************************************/
@@ -26,19 +40,198 @@ char theProgramTitle[] = "Ray Tracing Demo";
 int theWindowWidth = 800, theWindowHeight = 800;
 int theWindowPositionX = 40, theWindowPositionY = 40;
 bool isFullScreen = false;
+
+// Headless mode (--headless): an offscreen context renders one image of
+// theWindowWidth x theWindowHeight into a framebuffer object and writes it to
+// headlessImagePath, with the frame times in headlessTimingPath
+bool headless = false;
+int headlessSamples = 1;             // progressive samples per pixel
+int softShadowMode = -1;             // --shadows: -1 soft in progressive and denoised frames, 0 hard, 1 soft
+const char *headlessImagePath = "render.ppm";
+const char *headlessTimingPath = "render_timing.json";
+const char *sceneName = "default";   // "default", or "light-grid" to add a 10x10 grid of lights
 bool isAnimating = true;
 float rotation = 0.0f;
 GLuint VBO, VAO, IBO;
+GLuint rasterProgramID;
 GLuint gWorldLocation;
 GLuint gViewLocation;
 GLuint gProjectionLocation;
 
 // Ray tracing variables
 GLuint rayTraceProgramID;
+bool useSpecializedShaders = true;  // Bake the settings below into the ray tracing program
+std::map<std::string, GLuint> rayTraceProgramCache;  // Specialized programs keyed by their #defines
+
+// Change-driven rendering: the ray-traced image is kept in an offscreen target
+// and only traced again when the scene state or the window size changes
+GLuint rayTraceTargetTexture;
+GLuint rayTraceOutputTexture;        // Texture shown by the present pass
+GLuint presentProgramID;
+GLuint lastRayTraceProgramID = 0;
+bool sceneDirty = true;              // Set by changes that are not visible in the uniform blocks
+bool rayTraceImageUpdated = false;   // Whether the last frame traced a new image
+double idleWaitSeconds = 0.1;        // Longest time to block for events while idle
+
+// How each frame of the ray-traced image is produced
+enum FrameMode {
+    FRAME_MODE_FULL = 0,         // Trace one sample per pixel when something changed
+    FRAME_MODE_PROGRESSIVE,      // Keep adding jittered samples to a running average
+    FRAME_MODE_TEMPORAL,         // Reproject the previous image during camera motion
+    FRAME_MODE_TILED,            // Spread each image over several frames, a few tiles at a time
+    FRAME_MODE_INTERLACED,       // Trace half or a quarter of the pixels per frame and reconstruct
+    FRAME_MODE_DENOISED,         // Trace one noisy sample per pixel and denoise it
+    FRAME_MODE_COUNT
+};
+const char* frameModeNames[FRAME_MODE_COUNT] = { "Full", "Progressive", "Temporal", "Tiled", "Interlaced", "Denoised" };
+int frameMode = FRAME_MODE_FULL;
+int lastFrameMode = FRAME_MODE_FULL;
+
+// Progressive accumulation state, two float targets used in ping-pong fashion
+GLuint accumulationTextures[2];
+GLuint accumulationMoments[2];       // Per-pixel luminance moments and sample count
+int accumulationCurrent = 0;         // Index of the target holding the running average
+int accumulatedSamples = 0;
+int maxAccumulatedSamples = 256;
+int accumulationGeneration = 0;      // Incremented whenever accumulation restarts
+
+// Variance-guided adaptive sampling: after adaptiveMinSamples, only tiles whose
+// estimated relative error is above adaptiveThreshold receive more samples
+bool adaptiveSampling = true;
+bool lastAdaptiveSampling = true;
+float adaptiveThreshold = 0.02f;
+float lastAdaptiveThreshold = 0.02f;
+int adaptiveMinSamples = 8;
+int adaptiveTileSize = 8;
+GLuint sampleMaskTexture;
+GLuint sampleMaskProgramID;
+GLint sampleMaskTileSizeLoc, sampleMaskThresholdLoc;
+GLuint adaptiveQuery = 0;            // GL_SAMPLES_PASSED over the mask pass counts active tiles
+bool adaptiveQueryPending = false;
+int adaptiveQueryGeneration = 0;
+int adaptiveQueryTiles = 0;
+int adaptiveActiveTiles = -1;        // Latest count, -1 while unknown
+int adaptiveTileCount = 0;
+double adaptivePixelSamples = 0.0;   // Samples traced since the restart, summed over pixels
+
+// Temporal reprojection state. Each of the two ping-pong targets holds the
+// color and the primary hit positions of one traced frame.
+GLuint temporalTextures[2][2];       // [target][color, primary hit]
+int temporalCurrent = 0;             // Index of the target holding the latest frame
+bool temporalHistoryValid = false;   // Whether the latest frame may be reprojected
+glm::mat4 temporalViewProjection;    // Camera the latest frame was traced with
+int temporalFrame = 0;
+int temporalRefreshPeriod = 8;       // One pixel in this many is re-traced every frame
+int temporalRefreshFrames = 0;       // Frames left until every pixel was re-traced after motion
+
+// Time-sliced tiled rendering: the image is traced in scissored tiles into a
+// persistent target, with as many tiles per frame as fit into the budget
+GLuint tiledTargetTexture;
+int tileSize = 64;
+int lastTileSize = 64;
+float tileBudgetMs = 8.0f;           // GPU time to spend on tiles per frame
+double tileCostMs = 0.0;             // Measured GPU time of one tile
+int tilesPerFrame = 1;
+int tileNext = 0;                    // Next tile of the image in progress
+int tileCount = 0;
+
+// Interlaced tracing: each frame traces one phase of the pixels (checkerboard
+// or one pixel per 2x2 block) into a persistent samples target, and a
+// reconstruction pass fills in the other pixels
+const char* interlaceModeNames[2] = { "Half (checkerboard)", "Quarter (2x2)" };
+int interlaceMode = 0;
+int lastInterlacePhases = 2;
+int interlaceStep = 0;
+int interlaceValidPhases = 0;        // Bit p set when phase p was traced since the last change
+GLuint interlaceSamplesTexture, interlaceOutputTexture;
+GLuint reconstructProgramID;
+GLint reconstructPhaseCountLoc, reconstructCurrentPhaseLoc, reconstructValidPhasesLoc;
+
+// Spatio-temporal denoising in the style of SVGF: every frame traces one
+// sample per pixel along with the position, normal and albedo of its primary
+// hit. A temporal pass blends the color divided by the albedo with the
+// reprojected history and estimates its variance, then denoiseIterations
+// edge-avoiding a-trous passes filter it and multiply the albedo back in.
+enum DenoisePass { DENOISE_TRACE = 0, DENOISE_TEMPORAL, DENOISE_ATROUS, DENOISE_PASS_COUNT };
+const char* denoisePassNames[DENOISE_PASS_COUNT] = { "Trace", "Temporal", "A-trous" };
+GpuTimer denoiseTimers[DENOISE_PASS_COUNT];
+int denoiseIterations = 4;
+float denoiseColorAlpha = 0.2f;      // Weight of a new frame in the history
+float denoiseMomentsAlpha = 0.2f;
+int denoiseFrame = 0;                // Seeds the random numbers of each frame
+int denoiseCurrent = 0;              // Ping-pong index of the latest frame and history
+int denoiseStillFrames = 0;          // Frames traced since the last change
+int denoiseSettleFrames = 32;        // Frames to keep tracing after a change
+bool denoiseHistoryValid = false;
+glm::mat4 denoiseViewProjection;     // Camera of the latest frame
+GLuint denoiseFrameTextures[2][5];   // [target][color, primary hit, -, normal, albedo]
+GLuint denoiseHistoryTextures[2][2]; // [target][illumination and variance, moments]
+GLuint denoiseFilterTextures[2], denoiseOutputTexture;
+GLuint denoiseTemporalProgramID, denoiseAtrousProgramID;
+GLint denoisePreviousViewProjectionLoc, denoiseTemporalEyeLoc, denoiseHistoryValidLoc;
+GLint denoiseColorAlphaLoc, denoiseMomentsAlphaLoc;
+GLint denoiseStepSizeLoc, denoiseAtrousEyeLoc, denoisePixelFootprintLoc, denoiseModulateLoc;
+
+// Per-pass GPU times of every frame, shown in the GPU Profiler panel
+enum ProfileSection { PROFILE_RAY_TRACING = 0, PROFILE_RASTER, PROFILE_IMGUI, PROFILE_SECTION_COUNT };
+const char* profileSectionNames[PROFILE_SECTION_COUNT] = { "Ray tracing", "Raster", "ImGui" };
+GpuProfiler gpuProfiler;
+
+// CPU and GPU frame time statistics of the session, written to
+// <frameStatsPath>.csv and <frameStatsPath>.json on exit
+FrameStats frameStats;
+const char* frameStatsPath = "frame_stats";
+
+// Dynamic resolution: the ray-traced image is rendered at renderScale times the
+// window size, with the scale driven by a PI controller on the measured GPU time
+GpuTimer rayTraceTimer;
+bool dynamicResolution = false;
+float renderScale = 1.0f;
+float minRenderScale = 0.25f;
+float maxRenderScale = 1.0f;
+float targetFrameMs = 16.0f;
+float resolutionKp = 0.15f;          // Proportional gain
+float resolutionKi = 0.05f;          // Integral gain
+float resolutionIntegral = 1.0f / resolutionKi;  // Starts the controller at full scale
+float upscaleSharpness = 4.0f;
+int renderWidth = 1, renderHeight = 1;
+GLint presentSourceSizeLoc, presentSharpnessLoc;
+
+// Wavefront ray tracing on compute shaders (GL 4.3), used for Full frames when
+// enabled. Each stage of wavefront.comp is compiled into its own program.
+enum WavefrontStage {
+    WAVEFRONT_GENERATE = 0,
+    WAVEFRONT_PREPARE_EXTEND,
+    WAVEFRONT_EXTEND,
+    WAVEFRONT_SHADE,
+    WAVEFRONT_PREPARE_SHADOW,
+    WAVEFRONT_SHADOW,
+    WAVEFRONT_ACCUMULATE,
+    WAVEFRONT_RESOLVE,
+    WAVEFRONT_STAGE_COUNT
+};
+const char* wavefrontStageNames[WAVEFRONT_STAGE_COUNT] = {
+    "GENERATE", "PREPARE_EXTEND", "EXTEND", "SHADE", "PREPARE_SHADOW", "SHADOW", "ACCUMULATE", "RESOLVE"
+};
+#define WAVEFRONT_GROUP_SIZE 64
+#define WAVEFRONT_QUEUE_DISPATCH_OFFSET 12   // byte offsets of the dispatch arguments
+#define WAVEFRONT_SHADOW_DISPATCH_OFFSET 24  // in the WavefrontCounters buffer
+GLuint wavefrontPrograms[WAVEFRONT_STAGE_COUNT];
+GLint wavefrontQueueIndexLocs[WAVEFRONT_STAGE_COUNT];
+GLint wavefrontBounceLocs[WAVEFRONT_STAGE_COUNT];
+bool wavefrontSupported = false;
+bool useWavefront = false;
+bool lastUseWavefront = false;
+
+// Results of the last fragment vs. wavefront benchmark, in ms per frame
+bool benchmarkRequested = false;
+int benchmarkFrames = 20;
+double benchmarkMs[2] = { 0.0, 0.0 };
 GLuint quadVAO, quadVBO;
 bool useRayTracing = true;
 bool enableShadows = true;
 bool enableReflections = true;
+float glossyRoughness = 0.0f;          // Spread of reflection rays, 0 for mirrors
 int maxBounces = 3;
 float reflectivity = 0.5f;
 
@@ -46,11 +239,25 @@ float reflectivity = 0.5f;
 GLuint meshDataTexture;
 int meshTextureSize;
 
-// Scene objects for ray tracing
-struct RayTracingObject {
-    int type;           // 0 = sphere, 1 = cube, 2 = mesh
+// Scene primitives for ray tracing. Each type is kept in its own array and
+// uploaded to its own arrays in the SceneBlock, see rt_common.glsl.
+struct SpherePrimitive {
+    glm::vec3 center;
+    float radius;
+    glm::vec3 color;
+    float reflectivity;
+};
+
+struct BoxPrimitive {
+    glm::vec3 center;
+    glm::vec3 halfSize;
+    glm::vec3 color;
+    float reflectivity;
+};
+
+// Instance of the loaded mesh, translated to position
+struct MeshInstance {
     glm::vec3 position;
-    glm::vec3 size;     // radius for sphere, half-size for cube
     glm::vec3 color;
     float reflectivity;
 };
@@ -66,22 +273,88 @@ struct Triangle {
 #define MAX_TRIANGLES 5000
 Triangle meshTriangles[MAX_TRIANGLES];
 int numTriangles = 0;
-int meshObjectIndex = -1;  // Index of mesh object in scene objects array
-
-#define MAX_OBJECTS 16
-RayTracingObject sceneObjects[MAX_OBJECTS];
-int numObjects = 0;
+glm::vec3 meshBoundsMin(0.0f), meshBoundsMax(0.0f);  // Mesh bounds in object space
+
+// Capacities of the SceneBlock arrays
+#define MAX_SPHERES 16
+#define MAX_BOXES 16
+#define MAX_MESH_INSTANCES 4
+#define PRIMITIVES_PER_TYPE 16  // primitive ids are type * PRIMITIVES_PER_TYPE + index
+#define PRIMITIVE_SPHERE 0
+#define PRIMITIVE_BOX 1
+#define PRIMITIVE_MESH 2
+std::vector<SpherePrimitive> spheres;
+std::vector<BoxPrimitive> boxes;
+std::vector<MeshInstance> meshInstances;
 
 // Light sources
 struct Light {
     glm::vec3 position;
     glm::vec3 color;
     float intensity;
+    float radius;       // size of the light for soft shadows, 0 for a point light
+    float range;        // distance at which the light fades out, 0 for an unbounded light
 };
 
-#define MAX_LIGHTS 4
-Light lights[MAX_LIGHTS];
-int numLights = 0;
+// The number of lights is not limited; with more than lightSamplesPerHit of
+// them each hit traces that many shadow rays towards lights picked from the
+// light tree
+std::vector<Light> lights;
+int lightSamplesPerHit = 4;
+int lightTreeNodeCount = 0;
+
+// Tiled light culling: lights are binned into clusters of
+// LIGHT_CLUSTER_TILE_SIZE pixels and one of LIGHT_CLUSTER_SLICES view depth
+// slices, spaced exponentially between the near and far distance. Primary
+// hits shade exactly the lights whose range reaches their cluster.
+#define LIGHT_CLUSTER_TILE_SIZE 32
+#define LIGHT_CLUSTER_SLICES 16
+#define LIGHT_CLUSTER_NEAR 0.5f
+#define LIGHT_CLUSTER_FAR 100.0f
+bool lightCulling = true;
+float lightClusterAverage = 0.0f;   // Lights per non-empty cluster
+int lightClusterMax = 0;
+
+// Rasterized shadow maps: with useShadowMaps the first MAX_SHADOW_MAP_LIGHTS
+// lights get omnidirectional shadow maps, six faces in a 2D texture array,
+// that primary hits read instead of tracing shadow rays. The maps are rendered
+// again only when a light moves or the geometry changes.
+#define MAX_SHADOW_MAP_LIGHTS 8
+#define SHADOW_MAP_NEAR 0.05f
+#define SHADOW_MAP_FAR 100.0f
+const char* shadowMapSizeNames[] = { "256", "512", "1024", "2048" };
+bool useShadowMaps = false;
+int shadowMapSizeIndex = 1;
+bool shadowMapsDirty = true;
+int shadowMapRenders = 0;                 // Number of times the maps were rendered
+std::vector<float> shadowMapSignature;    // Caster and light placement the maps show
+GLuint shadowMapTexture;
+GLuint shadowMapProgramID;
+GLint shadowMapWorldLoc, shadowMapFaceLoc, shadowMapLightLoc;
+int shadowCubeIndexCount, shadowSphereIndexCount;
+
+// Hybrid primary visibility: all objects are rasterized into a G-buffer of
+// position and normal plus object slot, and rays are only traced from it for
+// shadows and reflections. The G-buffer is redrawn when the view or scene changes.
+bool useHybridPrimary = false;
+GLuint gbufferTextures[2];
+GLuint gbufferProgramID;
+GLint gbufferWorldLoc, gbufferViewProjectionLoc, gbufferPrimitiveLoc;
+
+// Function to compute the view projection of shadow map face (+X, -X, +Y, -Y,
+// +Z, -Z) for a light at the origin
+glm::mat4 ShadowFaceMatrix(int face) {
+    static const glm::vec3 directions[6] = {
+        glm::vec3(1, 0, 0), glm::vec3(-1, 0, 0), glm::vec3(0, 1, 0),
+        glm::vec3(0, -1, 0), glm::vec3(0, 0, 1), glm::vec3(0, 0, -1)
+    };
+    static const glm::vec3 ups[6] = {
+        glm::vec3(0, -1, 0), glm::vec3(0, -1, 0), glm::vec3(0, 0, 1),
+        glm::vec3(0, 0, -1), glm::vec3(0, -1, 0), glm::vec3(0, -1, 0)
+    };
+    glm::mat4 projection = glm::perspective(glm::radians(90.0f), 1.0f, SHADOW_MAP_NEAR, SHADOW_MAP_FAR);
+    return projection * glm::lookAt(glm::vec3(0.0f), directions[face], ups[face]);
+}
 glm::vec3 ambientLight(0.1f, 0.1f, 0.1f);
 
 // Camera variables
@@ -93,12 +366,23 @@ float cameraFOV = 45.0f;
 OffModel* model = NULL;
 int numVertices = 0;
 int numIndices = 0;
+int numTracedIndices = 0;   // leading indices that hold the ray-traced triangles
 
 /* Constants */
 const char *pVSFileName = "shaders/shader.vs";
 const char *pFSFileName = "shaders/shader.fs";
 const char *pRayTraceVSFileName = "shaders/quad.vs";
 const char *pRayTraceFSFileName = "shaders/raytrace.fs";
+const char *pPresentFSFileName = "shaders/present.fs";
+const char *pWavefrontCSFileName = "shaders/wavefront.comp";
+const char *pReconstructFSFileName = "shaders/reconstruct.fs";
+const char *pSampleMaskFSFileName = "shaders/sample_mask.fs";
+const char *pShadowMapVSFileName = "shaders/shadow_map.vs";
+const char *pShadowMapFSFileName = "shaders/shadow_map.fs";
+const char *pGBufferVSFileName = "shaders/gbuffer.vs";
+const char *pGBufferFSFileName = "shaders/gbuffer.fs";
+const char *pDenoiseTemporalFSFileName = "shaders/denoise_temporal.fs";
+const char *pDenoiseAtrousFSFileName = "shaders/denoise_atrous.fs";
 char * offFilePath = "models/cube.off";
 
 // Function declarations
@@ -106,49 +390,63 @@ static void AddShader(GLuint ShaderProgram, const char *pShaderText, GLenum Shad
 
 // Function to add a sphere to the scene
 void AddSphere(glm::vec3 position, float radius, glm::vec3 color, float reflectivity = 0.5f) {
-    if (numObjects < MAX_OBJECTS) {
-        sceneObjects[numObjects].type = 0; // Sphere
-        sceneObjects[numObjects].position = position;
-        sceneObjects[numObjects].size = glm::vec3(radius);
-        sceneObjects[numObjects].color = color;
-        sceneObjects[numObjects].reflectivity = reflectivity;
-        numObjects++;
+    if (spheres.size() < MAX_SPHERES) {
+        SpherePrimitive sphere;
+        sphere.center = position;
+        sphere.radius = radius;
+        sphere.color = color;
+        sphere.reflectivity = reflectivity;
+        spheres.push_back(sphere);
     }
 }
 
-// Function to add a cube to the scene
+// Function to add an axis-aligned box (cube) to the scene, size is its half-size
 void AddCube(glm::vec3 position, glm::vec3 size, glm::vec3 color, float reflectivity = 0.5f) {
-    if (numObjects < MAX_OBJECTS) {
-        sceneObjects[numObjects].type = 1; // Cube
-        sceneObjects[numObjects].position = position;
-        sceneObjects[numObjects].size = size;
-        sceneObjects[numObjects].color = color;
-        sceneObjects[numObjects].reflectivity = reflectivity;
-        numObjects++;
+    if (boxes.size() < MAX_BOXES) {
+        BoxPrimitive box;
+        box.center = position;
+        box.halfSize = size;
+        box.color = color;
+        box.reflectivity = reflectivity;
+        boxes.push_back(box);
     }
 }
 
-// Function to add a mesh to the scene
+// Function to add an instance of the loaded mesh to the scene
 void AddMesh(glm::vec3 position, glm::vec3 color, float reflectivity = 0.5f) {
-    if (numObjects < MAX_OBJECTS && meshObjectIndex == -1) {
-        meshObjectIndex = numObjects;
-        sceneObjects[numObjects].type = 2; // Mesh
-        sceneObjects[numObjects].position = position;
-        sceneObjects[numObjects].size = glm::vec3(1.0f); // Not used for mesh
-        sceneObjects[numObjects].color = color;
-        sceneObjects[numObjects].reflectivity = reflectivity;
-        numObjects++;
+    if (meshInstances.size() < MAX_MESH_INSTANCES) {
+        MeshInstance instance;
+        instance.position = position;
+        instance.color = color;
+        instance.reflectivity = reflectivity;
+        meshInstances.push_back(instance);
     }
 }
 
 // Function to add a light to the scene
-void AddLight(glm::vec3 position, glm::vec3 color, float intensity) {
-    if (numLights < MAX_LIGHTS) {
-        lights[numLights].position = position;
-        lights[numLights].color = color;
-        lights[numLights].intensity = intensity;
-        numLights++;
+void AddLight(glm::vec3 position, glm::vec3 color, float intensity, float radius = 0.3f, float range = 0.0f) {
+    Light light;
+    light.position = position;
+    light.color = color;
+    light.intensity = intensity;
+    light.radius = radius;
+    light.range = range;
+    lights.push_back(light);
+}
+
+// Function to add a countX x countZ grid of small lights over the floor, as in
+// a ceiling of downlights. Colors vary slightly so the selection is visible.
+// The lights fade out at range, so light culling leaves each pixel a few.
+void AddLightGrid(int countX, int countZ, float height, float totalIntensity, float range) {
+    float intensity = totalIntensity / (countX * countZ);
+    for (int z = 0; z < countZ; z++) {
+        for (int x = 0; x < countX; x++) {
+            glm::vec3 position(-4.5f + 9.0f * (x + 0.5f) / countX, height, -4.5f + 9.0f * (z + 0.5f) / countZ);
+            glm::vec3 color(0.8f + 0.2f * (float)x / countX, 0.9f, 0.8f + 0.2f * (float)z / countZ);
+            AddLight(position, color, intensity, 0.05f, range);
+        }
     }
+    sceneDirty = true;
 }
 
 // Function to prepare mesh triangles from the OFF model for ray tracing
@@ -199,9 +497,10 @@ void PrepareMeshForRayTracing() {
             int v1Idx = poly.v[j + 1];
             int v2Idx = poly.v[j + 2];
             
-            if (v0Idx >= model->numberOfVertices || 
-                v1Idx >= model->numberOfVertices || 
-                v2Idx >= model->numberOfVertices) continue;
+            // Skip the same triangles as LoadOffModel, so both keep the same set
+            if (v0Idx < 0 || v0Idx >= model->numberOfVertices ||
+                v1Idx < 0 || v1Idx >= model->numberOfVertices ||
+                v2Idx < 0 || v2Idx >= model->numberOfVertices) continue;
             
             // Add normalized vertices to the data array
             // Vertex 0
@@ -236,6 +535,36 @@ void PrepareMeshForRayTracing() {
             triangleCount++;
         }
     }
+    numTriangles = triangleCount;
+    
+    // Sort triangles along a Morton curve so that spatially close triangles
+    // occupy neighbouring texture rows
+    std::vector<glm::vec3> centroids(triangleCount);
+    for (int i = 0; i < triangleCount; i++) {
+        const float* t = &triangleData[i * 12];
+        centroids[i] = glm::vec3(t[0] + t[3] + t[6], t[1] + t[4] + t[7], t[2] + t[5] + t[8]) / 3.0f;
+    }
+    std::vector<unsigned int> triangleOrder;
+    ComputeMortonOrder(centroids, triangleOrder);
+    
+    std::vector<float> sortedTriangleData(triangleData.size());
+    for (int i = 0; i < triangleCount; i++) {
+        std::copy(triangleData.begin() + triangleOrder[i] * 12,
+                  triangleData.begin() + triangleOrder[i] * 12 + 12,
+                  sortedTriangleData.begin() + i * 12);
+    }
+    triangleData.swap(sortedTriangleData);
+    
+    // Object-space bounds of the triangles, used to skip the mesh in the shader
+    meshBoundsMin = glm::vec3(1e30f);
+    meshBoundsMax = glm::vec3(-1e30f);
+    for (int i = 0; i < triangleCount; i++) {
+        for (int k = 0; k < 3; k++) {
+            const float* v = &triangleData[i * 12 + k * 3];
+            meshBoundsMin = glm::min(meshBoundsMin, glm::vec3(v[0], v[1], v[2]));
+            meshBoundsMax = glm::max(meshBoundsMax, glm::vec3(v[0], v[1], v[2]));
+        }
+    }
     
     // Calculate texture dimensions - must be power of 2 for best compatibility
     // Each row stores one triangle (12 floats), we'll use a 2D RGBA32F texture
@@ -255,21 +584,7 @@ void PrepareMeshForRayTracing() {
     
     meshTextureSize = textureWidth * textureHeight * 4; // * 4 for RGBA
     
-    // Create and bind a texture to store mesh data
-    glGenTextures(1, &meshDataTexture);
-    glBindTexture(GL_TEXTURE_2D, meshDataTexture);
-    
-    // Set texture parameters
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    
-    // Create empty texture with the right size
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, textureWidth, textureHeight, 
-                0, GL_RGBA, GL_FLOAT, nullptr);
-    
-    // Now fill the texture with our triangle data
+    // Fill the texture with our triangle data
     // We need to convert our array of 12 floats per triangle to an array of RGBA texels
     std::vector<float> texelData(textureWidth * textureHeight * 4, 0.0f);
     
@@ -281,23 +596,81 @@ void PrepareMeshForRayTracing() {
         }
     }
     
-    // Upload the data to the texture
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, textureWidth, textureHeight,
-                  GL_RGBA, GL_FLOAT, texelData.data());
+    // Upload the data, reusing the mesh texture from a previous call when the size matches
+    meshDataTexture = GpuTexImage2D("meshData", GL_RGBA32F, textureWidth, textureHeight,
+                                    GL_RGBA, GL_FLOAT, texelData.data());
+    
+    // Set texture parameters
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     
     // Unbind the texture
     glBindTexture(GL_TEXTURE_2D, 0);
     
+    sceneDirty = true;
+    
     printf("Prepared %d triangles for ray tracing in a %dx%d texture\n", 
            triangleCount, textureWidth, textureHeight);
 }
 
+// Order in which the primitives of each type are uploaded to the shader, as
+// indices into spheres, boxes and meshInstances
+struct PrimitiveOrder {
+    std::vector<int> spheres;
+    std::vector<int> boxes;
+    std::vector<int> meshInstances;
+};
+
+// Function to return the distance from the camera to a bounding box, 0 inside it
+float CameraDistance(glm::vec3 boundsMin, glm::vec3 boundsMax) {
+    return glm::length(glm::max(glm::max(boundsMin - cameraPosition, cameraPosition - boundsMax), glm::vec3(0.0f)));
+}
+
+// Function to sort indices 0..distance.size()-1 by increasing distance
+void SortByDistance(const std::vector<float>& distance, std::vector<int>& order) {
+    order.resize(distance.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = (int)i;
+    }
+    std::sort(order.begin(), order.end(), [&distance](int a, int b) {
+        return distance[a] < distance[b];
+    });
+}
+
+// Function to compute the order in which the primitives are uploaded to the
+// shader. The shader tests spheres, then boxes, then mesh instances, and each
+// type is sorted by distance from the camera so that the closest hit found
+// early tightens the ray interval for the rest.
+void ComputePrimitiveOrder(PrimitiveOrder& order) {
+    std::vector<float> distance(spheres.size());
+    for (size_t i = 0; i < spheres.size(); i++) {
+        distance[i] = CameraDistance(spheres[i].center - glm::vec3(spheres[i].radius),
+                                     spheres[i].center + glm::vec3(spheres[i].radius));
+    }
+    SortByDistance(distance, order.spheres);
+    
+    distance.resize(boxes.size());
+    for (size_t i = 0; i < boxes.size(); i++) {
+        distance[i] = CameraDistance(boxes[i].center - boxes[i].halfSize, boxes[i].center + boxes[i].halfSize);
+    }
+    SortByDistance(distance, order.boxes);
+    
+    distance.resize(meshInstances.size());
+    for (size_t i = 0; i < meshInstances.size(); i++) {
+        distance[i] = CameraDistance(meshInstances[i].position + meshBoundsMin, meshInstances[i].position + meshBoundsMax);
+    }
+    SortByDistance(distance, order.meshInstances);
+}
+
 // Function to set up a basic scene
 void SetupScene() {
     // Clear any existing objects
-    numObjects = 0;
-    numLights = 0;
-    meshObjectIndex = -1;
+    spheres.clear();
+    boxes.clear();
+    meshInstances.clear();
+    lights.clear();
     
     // Add objects to the scene
     AddSphere(glm::vec3(0.0f, 0.0f, 0.0f), 0.5f, glm::vec3(1.0f, 0.2f, 0.2f), 0.7f);
@@ -315,6 +688,135 @@ void SetupScene() {
     // Add lights
     AddLight(glm::vec3(5.0f, 5.0f, 5.0f), glm::vec3(1.0f, 1.0f, 1.0f), 1.0f);
     AddLight(glm::vec3(-5.0f, 3.0f, -3.0f), glm::vec3(0.5f, 0.5f, 0.8f), 0.8f);
+    
+    sceneDirty = true;
+}
+
+// Function to set up the scene selected with --scene
+void SetupNamedScene() {
+    SetupScene();
+    if (!strcmp(sceneName, "light-grid")) {
+        AddLightGrid(10, 10, 2.5f, 4.0f, 4.0f);
+    }
+}
+
+// Uniform block layouts shared with raytrace.fs. All members follow std140
+// rules, a vec3 followed by a scalar shares one 16-byte slot.
+#define SETTINGS_BLOCK_BINDING 0
+#define SCENE_BLOCK_BINDING 1
+#define LIGHT_BLOCK_BINDING 2
+#define CAMERA_BLOCK_BINDING 3
+
+struct CameraBlockData {
+    glm::vec3 cameraPosition;
+    float pad0;
+    glm::vec3 rayBase;
+    float pad1;
+    glm::vec3 pixelDeltaX;
+    float pad2;
+    glm::vec3 pixelDeltaY;
+    float pad3;
+    glm::vec2 screenSize;
+    float pad4[2];
+};
+
+struct SettingsBlockData {
+    float reflectivity;
+    int shadowsEnabled;
+    int reflectionsEnabled;
+    int bounceLimit;
+    int softShadows;
+    int shadowMapLights;
+    int hybridPrimary;
+    float roughness;
+};
+
+struct SceneBlockData {
+    glm::vec4 sphereGeometry[MAX_SPHERES];
+    glm::vec4 sphereMaterial[MAX_SPHERES];
+    glm::vec4 boxMin[MAX_BOXES];
+    glm::vec4 boxMax[MAX_BOXES];
+    glm::vec4 boxMaterial[MAX_BOXES];
+    glm::vec4 meshOffset[MAX_MESH_INSTANCES];
+    glm::vec4 meshBoundsMin[MAX_MESH_INSTANCES];
+    glm::vec4 meshBoundsMax[MAX_MESH_INSTANCES];
+    glm::vec4 meshMaterial[MAX_MESH_INSTANCES];
+    int sphereCount;
+    int boxCount;
+    int meshInstanceCount;
+    int numTriangles;
+    int meshTextureSize;
+    int pad0;
+    int pad1;
+    int pad2;
+};
+
+struct LightBlockData {
+    glm::vec3 ambientLight;
+    int lightCount;
+    int lightSamples;
+    int lightCulling;
+    int clusterTileSize;
+    int clusterSlices;
+    int clusterTilesX;
+    int clusterTilesY;
+    float clusterNear;
+    float clusterFar;
+};
+
+static_assert(sizeof(CameraBlockData) == 80, "CameraBlockData must match the std140 CameraBlock layout");
+static_assert(sizeof(SceneBlockData) == 16 * (2 * MAX_SPHERES + 3 * MAX_BOXES + 4 * MAX_MESH_INSTANCES + 2),
+              "SceneBlockData must match the std140 SceneBlock layout");
+static_assert(sizeof(LightBlockData) == 48, "LightBlockData must match the std140 LightBlock layout");
+
+// Locations of the per-sample uniforms of each ray tracing program, resolved at link time
+struct RayTraceLocations {
+    GLint sampleIndex;
+    GLint randomSeed;
+    GLint temporalEnabled;
+    GLint temporalFrame;
+    GLint temporalRefreshPeriod;
+    GLint previousViewProjection;
+    GLint interlacePhases;
+    GLint interlacePhase;
+    GLint adaptiveSampling;
+    GLint maskTileSize;
+};
+std::map<GLuint, RayTraceLocations> rayTraceLocations;
+
+// Contents of each uniform buffer as last uploaded
+std::vector<unsigned char> uploadedCameraBlock, uploadedSettingsBlock, uploadedSceneBlock, uploadedLightBlock;
+std::vector<unsigned char> uploadedLightData, uploadedLightTree, uploadedLightClusters;
+GLuint lightDataTexture, lightTreeTexture, lightClusterTexture;
+
+// Function to upload a uniform block only when its contents changed since the
+// last upload. Returns true if the block was uploaded.
+bool UpdateUniformBlock(const char* name, GLuint binding, const void* data, size_t size,
+                        std::vector<unsigned char>& uploaded) {
+    if (uploaded.size() == size && memcmp(&uploaded[0], data, size) == 0) {
+        return false;
+    }
+    uploaded.assign((const unsigned char*)data, (const unsigned char*)data + size);
+    GLuint buffer = GpuBufferData(name, GL_UNIFORM_BUFFER, size, data, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, binding, buffer);
+    return true;
+}
+
+// Function to upload texels of the given format to the texture buffer name
+// when they changed since the last upload. The buffer texture is named
+// "<name>:texture". Returns true if the data was uploaded.
+bool UpdateTextureBuffer(const char* name, GLenum format, const void* data, size_t size,
+                         std::vector<unsigned char>& uploaded, GLuint* texture) {
+    *texture = GpuTexture((std::string(name) + ":texture").c_str());
+    if (uploaded.size() == size && memcmp(&uploaded[0], data, size) == 0) {
+        return false;
+    }
+    uploaded.assign((const unsigned char*)data, (const unsigned char*)data + size);
+    GLuint buffer = GpuBufferData(name, GL_TEXTURE_BUFFER, size, data, GL_DYNAMIC_DRAW);
+    glBindTexture(GL_TEXTURE_BUFFER, *texture);
+    glTexBuffer(GL_TEXTURE_BUFFER, format, buffer);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    return true;
 }
 
 // Function to create a fullscreen quad for ray tracing
@@ -328,22 +830,68 @@ void CreateQuad() {
     };
     
     // setup plane VAO
-    glGenVertexArrays(1, &quadVAO);
-    glGenBuffers(1, &quadVBO);
+    quadVAO = GpuVertexArray("quadVAO");
     glBindVertexArray(quadVAO);
-    glBindBuffer(GL_ARRAY_BUFFER, quadVBO);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(quadVertices), &quadVertices, GL_STATIC_DRAW);
+    quadVBO = GpuBufferData("quadVertices", GL_ARRAY_BUFFER, sizeof(quadVertices), quadVertices, GL_STATIC_DRAW);
     glEnableVertexAttribArray(0);
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
     glEnableVertexAttribArray(1);
     glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
 }
 
-// Function to compile the ray tracing shader
-GLuint CompileRayTraceShaders() {
-    GLuint rayTraceProgramID = glCreateProgram();
+// Function to resolve the ray tracing program's bindings once after linking:
+// uniform blocks get fixed binding points and the sampler a fixed texture unit
+void SetupRayTraceProgram(GLuint program) {
+    const char* blockNames[] = { "SettingsBlock", "SceneBlock", "LightBlock", "CameraBlock" };
+    const GLuint blockBindings[] = { SETTINGS_BLOCK_BINDING, SCENE_BLOCK_BINDING, LIGHT_BLOCK_BINDING,
+                                     CAMERA_BLOCK_BINDING };
+    for (int i = 0; i < 4; i++) {
+        GLuint blockIndex = glGetUniformBlockIndex(program, blockNames[i]);
+        if (blockIndex != GL_INVALID_INDEX) {
+            glUniformBlockBinding(program, blockIndex, blockBindings[i]);
+        }
+    }
+    
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "meshDataTexture"), 0);
+    glUniform1i(glGetUniformLocation(program, "historyTexture"), 1);
+    glUniform1i(glGetUniformLocation(program, "previousColor"), 2);
+    glUniform1i(glGetUniformLocation(program, "previousHit"), 3);
+    glUniform1i(glGetUniformLocation(program, "historyMoments"), 4);
+    glUniform1i(glGetUniformLocation(program, "sampleMask"), 5);
+    glUniform1i(glGetUniformLocation(program, "lightData"), 6);
+    glUniform1i(glGetUniformLocation(program, "lightTree"), 7);
+    glUniform1i(glGetUniformLocation(program, "lightClusters"), 8);
+    glUniform1i(glGetUniformLocation(program, "shadowMaps"), 9);
+    glUniform1i(glGetUniformLocation(program, "gbufferPosition"), 10);
+    glUniform1i(glGetUniformLocation(program, "gbufferNormal"), 11);
+    glm::mat4 shadowFaces[6];
+    for (int face = 0; face < 6; face++) {
+        shadowFaces[face] = ShadowFaceMatrix(face);
+    }
+    glUniformMatrix4fv(glGetUniformLocation(program, "shadowFaceMatrices"), 6, GL_FALSE, glm::value_ptr(shadowFaces[0]));
+    glUseProgram(0);
     
-    if (rayTraceProgramID == 0) {
+    RayTraceLocations locations;
+    locations.sampleIndex = glGetUniformLocation(program, "sampleIndex");
+    locations.randomSeed = glGetUniformLocation(program, "randomSeed");
+    locations.temporalEnabled = glGetUniformLocation(program, "temporalEnabled");
+    locations.temporalFrame = glGetUniformLocation(program, "temporalFrame");
+    locations.temporalRefreshPeriod = glGetUniformLocation(program, "temporalRefreshPeriod");
+    locations.previousViewProjection = glGetUniformLocation(program, "previousViewProjection");
+    locations.interlacePhases = glGetUniformLocation(program, "interlacePhases");
+    locations.interlacePhase = glGetUniformLocation(program, "interlacePhase");
+    locations.adaptiveSampling = glGetUniformLocation(program, "adaptiveSampling");
+    locations.maskTileSize = glGetUniformLocation(program, "maskTileSize");
+    rayTraceLocations[program] = locations;
+}
+
+// Function to compile a program that draws the fullscreen quad with the given
+// fragment shader. The defines are inserted right after its #version line.
+GLuint CompileScreenShader(const char* pFSFileName, const std::string& defines) {
+    GLuint programID = glCreateProgram();
+    
+    if (programID == 0) {
         fprintf(stderr, "Error creating shader program\n");
         exit(1);
     }
@@ -351,67 +899,490 @@ GLuint CompileRayTraceShaders() {
     std::string vs, fs;
     
     if (!ReadFile(pRayTraceVSFileName, vs)) {
-        fprintf(stderr, "Error reading vertex shader for ray tracing\n");
+        fprintf(stderr, "Error reading vertex shader for %s\n", pFSFileName);
+        exit(1);
+    }
+    
+    if (!ReadShaderFile(pFSFileName, fs)) {
+        fprintf(stderr, "Error reading fragment shader %s\n", pFSFileName);
+        exit(1);
+    }
+    
+    if (!defines.empty()) {
+        size_t versionEnd = fs.find('\n') + 1;
+        fs.insert(versionEnd, defines);
+    }
+    
+    // Reuse the program binary from a previous run if there is one
+    std::string cacheKey = ShaderCacheKey(vs, fs);
+    if (!ShaderCacheLoad(programID, cacheKey)) {
+        AddShader(programID, vs.c_str(), GL_VERTEX_SHADER);
+        AddShader(programID, fs.c_str(), GL_FRAGMENT_SHADER);
+        
+        GLint Success = 0;
+        GLchar ErrorLog[1024] = {0};
+        
+        ShaderCachePrepare(programID);
+        glLinkProgram(programID);
+        glGetProgramiv(programID, GL_LINK_STATUS, &Success);
+        if (Success == 0) {
+            glGetProgramInfoLog(programID, sizeof(ErrorLog), NULL, ErrorLog);
+            fprintf(stderr, "Error linking shader program %s: '%s'\n", pFSFileName, ErrorLog);
+            exit(1);
+        }
+        ShaderCacheStore(programID, cacheKey);
+    }
+    
+    return programID;
+}
+
+// Function to compile a compute program from the given file, with the defines
+// inserted right after its #version line
+GLuint CompileComputeShader(const char* pCSFileName, const std::string& defines) {
+    GLuint programID = glCreateProgram();
+    
+    if (programID == 0) {
+        fprintf(stderr, "Error creating shader program\n");
         exit(1);
     }
     
-    if (!ReadFile(pRayTraceFSFileName, fs)) {
-        fprintf(stderr, "Error reading fragment shader for ray tracing\n");
+    std::string cs;
+    if (!ReadShaderFile(pCSFileName, cs)) {
+        fprintf(stderr, "Error reading compute shader %s\n", pCSFileName);
         exit(1);
     }
     
-    AddShader(rayTraceProgramID, vs.c_str(), GL_VERTEX_SHADER);
-    AddShader(rayTraceProgramID, fs.c_str(), GL_FRAGMENT_SHADER);
+    if (!defines.empty()) {
+        size_t versionEnd = cs.find('\n') + 1;
+        cs.insert(versionEnd, defines);
+    }
+    
+    std::string cacheKey = ShaderCacheKey("", cs);
+    if (!ShaderCacheLoad(programID, cacheKey)) {
+        AddShader(programID, cs.c_str(), GL_COMPUTE_SHADER);
+        
+        GLint Success = 0;
+        GLchar ErrorLog[1024] = {0};
+        
+        ShaderCachePrepare(programID);
+        glLinkProgram(programID);
+        glGetProgramiv(programID, GL_LINK_STATUS, &Success);
+        if (Success == 0) {
+            glGetProgramInfoLog(programID, sizeof(ErrorLog), NULL, ErrorLog);
+            fprintf(stderr, "Error linking compute program %s: '%s'\n", pCSFileName, ErrorLog);
+            exit(1);
+        }
+        ShaderCacheStore(programID, cacheKey);
+    }
+    
+    return programID;
+}
+
+// Function to compile a program from a vertex and a fragment shader file
+GLuint CompileRasterShader(const char* pVertexFileName, const char* pFragmentFileName) {
+    GLuint programID = glCreateProgram();
     
-    GLint Success = 0;
-    GLchar ErrorLog[1024] = {0};
+    if (programID == 0) {
+        fprintf(stderr, "Error creating shader program\n");
+        exit(1);
+    }
     
-    glLinkProgram(rayTraceProgramID);
-    glGetProgramiv(rayTraceProgramID, GL_LINK_STATUS, &Success);
-    if (Success == 0) {
-        glGetProgramInfoLog(rayTraceProgramID, sizeof(ErrorLog), NULL, ErrorLog);
-        fprintf(stderr, "Error linking ray tracing shader program: '%s'\n", ErrorLog);
+    std::string vs, fs;
+    if (!ReadShaderFile(pVertexFileName, vs)) {
+        fprintf(stderr, "Error reading vertex shader %s\n", pVertexFileName);
+        exit(1);
+    }
+    if (!ReadShaderFile(pFragmentFileName, fs)) {
+        fprintf(stderr, "Error reading fragment shader %s\n", pFragmentFileName);
         exit(1);
     }
     
+    std::string cacheKey = ShaderCacheKey(vs, fs);
+    if (!ShaderCacheLoad(programID, cacheKey)) {
+        AddShader(programID, vs.c_str(), GL_VERTEX_SHADER);
+        AddShader(programID, fs.c_str(), GL_FRAGMENT_SHADER);
+        
+        GLint Success = 0;
+        GLchar ErrorLog[1024] = {0};
+        
+        ShaderCachePrepare(programID);
+        glLinkProgram(programID);
+        glGetProgramiv(programID, GL_LINK_STATUS, &Success);
+        if (Success == 0) {
+            glGetProgramInfoLog(programID, sizeof(ErrorLog), NULL, ErrorLog);
+            fprintf(stderr, "Error linking shader program %s: '%s'\n", pFragmentFileName, ErrorLog);
+            exit(1);
+        }
+        ShaderCacheStore(programID, cacheKey);
+    }
+    
+    return programID;
+}
+
+// Function to create an indexed triangle mesh named name for the shadow map
+// pass. Returns the vertex array object.
+GLuint CreateShadowCasterMesh(const char* name, const std::vector<glm::vec3>& vertices,
+                              const std::vector<unsigned int>& indices) {
+    std::string prefix(name);
+    GLuint vao = GpuVertexArray((prefix + "VAO").c_str());
+    glBindVertexArray(vao);
+    GpuBufferData((prefix + "Vertices").c_str(), GL_ARRAY_BUFFER, vertices.size() * sizeof(glm::vec3), &vertices[0], GL_STATIC_DRAW);
+    GpuBufferData((prefix + "Indices").c_str(), GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), 0);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    return vao;
+}
+
+// Function to compile the shadow map program and create the raster geometry
+// of the analytic objects: a cube from -1 to 1 and a unit sphere. The sphere
+// is inscribed in the analytic one, so a sphere never shadows its own surface.
+void InitShadowMaps() {
+    shadowMapProgramID = GpuAdoptProgram("shadowMap", CompileRasterShader(pShadowMapVSFileName, pShadowMapFSFileName));
+    shadowMapWorldLoc = glGetUniformLocation(shadowMapProgramID, "gWorld");
+    shadowMapFaceLoc = glGetUniformLocation(shadowMapProgramID, "faceViewProjection");
+    shadowMapLightLoc = glGetUniformLocation(shadowMapProgramID, "lightPosition");
+    
+    std::vector<glm::vec3> vertices;
+    std::vector<unsigned int> indices;
+    for (int i = 0; i < 8; i++) {
+        vertices.push_back(glm::vec3((i & 1) ? 1.0f : -1.0f, (i & 2) ? 1.0f : -1.0f, (i & 4) ? 1.0f : -1.0f));
+    }
+    static const unsigned int cubeIndices[36] = {
+        0, 2, 1, 1, 2, 3,   4, 5, 6, 5, 7, 6,   0, 1, 4, 1, 5, 4,
+        2, 6, 3, 3, 6, 7,   0, 4, 2, 2, 4, 6,   1, 3, 5, 3, 7, 5
+    };
+    indices.assign(cubeIndices, cubeIndices + 36);
+    CreateShadowCasterMesh("shadowCube", vertices, indices);
+    shadowCubeIndexCount = (int)indices.size();
+    
+    const int slices = 24, stacks = 16;
+    vertices.clear();
+    indices.clear();
+    for (int stack = 0; stack <= stacks; stack++) {
+        float theta = glm::radians(180.0f) * stack / stacks;
+        for (int slice = 0; slice <= slices; slice++) {
+            float phi = glm::radians(360.0f) * slice / slices;
+            vertices.push_back(glm::vec3(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi)));
+        }
+    }
+    for (int stack = 0; stack < stacks; stack++) {
+        for (int slice = 0; slice < slices; slice++) {
+            unsigned int a = stack * (slices + 1) + slice;
+            unsigned int b = a + slices + 1;
+            unsigned int quad[6] = { a, b, a + 1, a + 1, b, b + 1 };
+            indices.insert(indices.end(), quad, quad + 6);
+        }
+    }
+    CreateShadowCasterMesh("shadowSphere", vertices, indices);
+    shadowSphereIndexCount = (int)indices.size();
+}
+
+// Function to draw one primitive with the bound program and vertex array
+static void DrawRasterPrimitive(GLint worldLoc, GLint idLoc, int id, const glm::mat4& world, int indexCount) {
+    glUniformMatrix4fv(worldLoc, 1, GL_FALSE, glm::value_ptr(world));
+    glUniform1i(idLoc, id);
+    glDrawElements(GL_TRIANGLES, indexCount, GL_UNSIGNED_INT, 0);
+}
+
+// Function to draw every ray-traced primitive with the bound program, setting
+// its model matrix at worldLoc and its primitive id at idLoc. order gives the
+// upload order that the ids refer to, NULL for scene order. With sphereBounds
+// spheres are drawn as their bounding cubes, for programs that intersect them
+// analytically. Meshes are drawn with the traced triangles only.
+void DrawRasterObjects(GLint worldLoc, GLint idLoc, const PrimitiveOrder* order, bool sphereBounds) {
+    glBindVertexArray(GpuVertexArray(sphereBounds ? "shadowCubeVAO" : "shadowSphereVAO"));
+    for (int slot = 0; slot < (int)spheres.size(); slot++) {
+        const SpherePrimitive& sphere = spheres[order ? order->spheres[slot] : slot];
+        glm::mat4 world = glm::scale(glm::translate(glm::mat4(1.0f), sphere.center), glm::vec3(sphere.radius));
+        DrawRasterPrimitive(worldLoc, idLoc, PRIMITIVE_SPHERE * PRIMITIVES_PER_TYPE + slot, world,
+                            sphereBounds ? shadowCubeIndexCount : shadowSphereIndexCount);
+    }
+    
+    glBindVertexArray(GpuVertexArray("shadowCubeVAO"));
+    for (int slot = 0; slot < (int)boxes.size(); slot++) {
+        const BoxPrimitive& box = boxes[order ? order->boxes[slot] : slot];
+        glm::mat4 world = glm::scale(glm::translate(glm::mat4(1.0f), box.center), box.halfSize);
+        DrawRasterPrimitive(worldLoc, idLoc, PRIMITIVE_BOX * PRIMITIVES_PER_TYPE + slot, world, shadowCubeIndexCount);
+    }
+    
+    if (model) {
+        glBindVertexArray(VAO);
+        for (int slot = 0; slot < (int)meshInstances.size(); slot++) {
+            const MeshInstance& instance = meshInstances[order ? order->meshInstances[slot] : slot];
+            glm::mat4 world = glm::translate(glm::mat4(1.0f), instance.position);
+            DrawRasterPrimitive(worldLoc, idLoc, PRIMITIVE_MESH * PRIMITIVES_PER_TYPE + slot, world, numTracedIndices);
+        }
+    }
+    glBindVertexArray(0);
+}
+
+// Function to render the shadow maps of the first lightCount lights if their
+// storage was reallocated or shadowMapsDirty is set. Keeps the bound
+// framebuffer and viewport. Returns true if the maps were rendered.
+bool UpdateShadowMaps(int lightCount) {
+    if (lightCount == 0) {
+        return false;
+    }
+    
+    int size = 256 << shadowMapSizeIndex;
+    GLuint depthTexture = GpuTexImage2D("shadowMapDepth", GL_DEPTH_COMPONENT24, size, size,
+                                        GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+    if (GpuTexImage3D("shadowMaps", GL_TEXTURE_2D_ARRAY, GL_R32F, size, size, lightCount * 6,
+                      GL_RED, GL_FLOAT, &shadowMapTexture)) {
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        shadowMapsDirty = true;
+    }
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    if (!shadowMapsDirty) {
+        return false;
+    }
+    
+    GLint previousFramebuffer, previousViewport[4];
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+    glGetIntegerv(GL_VIEWPORT, previousViewport);
+    GLboolean depthTest = glIsEnabled(GL_DEPTH_TEST);
+    
+    glBindFramebuffer(GL_FRAMEBUFFER, GpuFramebuffer("shadowMapFramebuffer"));
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTexture, 0);
+    glViewport(0, 0, size, size);
+    glEnable(GL_DEPTH_TEST);
+    glClearColor(SHADOW_MAP_FAR, SHADOW_MAP_FAR, SHADOW_MAP_FAR, SHADOW_MAP_FAR);
+    glUseProgram(shadowMapProgramID);
+    
+    for (int light = 0; light < lightCount; light++) {
+        glUniform3fv(shadowMapLightLoc, 1, glm::value_ptr(lights[light].position));
+        for (int face = 0; face < 6; face++) {
+            glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, shadowMapTexture, 0, light * 6 + face);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            glm::mat4 faceMatrix = ShadowFaceMatrix(face);
+            glUniformMatrix4fv(shadowMapFaceLoc, 1, GL_FALSE, glm::value_ptr(faceMatrix));
+            DrawRasterObjects(shadowMapWorldLoc, -1, NULL, false);
+        }
+    }
+    
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    if (!depthTest) glDisable(GL_DEPTH_TEST);
+    glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+    glViewport(previousViewport[0], previousViewport[1], previousViewport[2], previousViewport[3]);
+    shadowMapsDirty = false;
+    shadowMapRenders++;
+    return true;
+}
+
+// Function to compile the wavefront stages when compute shaders are available.
+// They share the uniform blocks and the mesh texture unit with the fragment path.
+void InitWavefront() {
+    wavefrontSupported = GLEW_VERSION_4_3 != 0;
+    if (!wavefrontSupported) {
+        printf("Compute shaders not available, wavefront ray tracing disabled\n");
+        return;
+    }
+    
+    for (int i = 0; i < WAVEFRONT_STAGE_COUNT; i++) {
+        std::string defines = std::string("#define WAVEFRONT_STAGE_") + wavefrontStageNames[i] + "\n";
+        std::string name = std::string("wavefront:") + wavefrontStageNames[i];
+        wavefrontPrograms[i] = GpuAdoptProgram(name.c_str(), CompileComputeShader(pWavefrontCSFileName, defines));
+        SetupRayTraceProgram(wavefrontPrograms[i]);
+        wavefrontQueueIndexLocs[i] = glGetUniformLocation(wavefrontPrograms[i], "queueIndex");
+        wavefrontBounceLocs[i] = glGetUniformLocation(wavefrontPrograms[i], "bounce");
+    }
+}
+
+// Function to compile the ray tracing shader with the given specialization defines
+GLuint CompileRayTraceShaders(const std::string& defines) {
+    GLuint rayTraceProgramID = CompileScreenShader(pRayTraceFSFileName, defines);
+    SetupRayTraceProgram(rayTraceProgramID);
     return rayTraceProgramID;
 }
 
+// Shadow rays traced per hit: one per light, up to lightSamplesPerHit
+int LightRaysPerHit() {
+    return glm::min((int)lights.size(), lightSamplesPerHit);
+}
+
+// Function to build the #defines that specialize the ray tracing program for
+// the current settings. Settings that cannot affect the image are normalized
+// so that they map to the same program.
+std::string RayTraceDefines() {
+    char defines[256];
+    snprintf(defines, sizeof(defines),
+             "#define ENABLE_SHADOWS %s\n"
+             "#define ENABLE_REFLECTIONS %s\n"
+             "#define MAX_BOUNCES %d\n"
+             "#define NUM_SPHERES %d\n"
+             "#define NUM_BOXES %d\n"
+             "#define NUM_MESH_INSTANCES %d\n"
+             "#define LIGHT_RAYS %d\n",
+             enableShadows ? "true" : "false",
+             enableReflections ? "true" : "false",
+             enableReflections ? maxBounces : 0,
+             (int)spheres.size(), (int)boxes.size(), model ? (int)meshInstances.size() : 0,
+             LightRaysPerHit());
+    return defines;
+}
+
+// Function to select the ray tracing program for the current settings,
+// compiling and caching a specialized variant on first use
+GLuint SelectRayTraceProgram() {
+    if (!useSpecializedShaders) {
+        return rayTraceProgramCache[""];
+    }
+    
+    std::string defines = RayTraceDefines();
+    std::map<std::string, GLuint>::iterator it = rayTraceProgramCache.find(defines);
+    if (it != rayTraceProgramCache.end()) {
+        return it->second;
+    }
+    
+    std::string name = "rayTrace:" + defines;
+    GLuint program = GpuAdoptProgram(name.c_str(), CompileRayTraceShaders(defines));
+    rayTraceProgramCache[defines] = program;
+    printf("Compiled ray tracing variant %d\n", (int)rayTraceProgramCache.size() - 1);
+    return program;
+}
+
+// Function to delete the generic and all specialized ray tracing programs
+void ReleaseRayTracePrograms() {
+    std::map<std::string, GLuint>::iterator it;
+    for (it = rayTraceProgramCache.begin(); it != rayTraceProgramCache.end(); ++it) {
+        std::string name = it->first.empty() ? "rayTrace" : "rayTrace:" + it->first;
+        GpuRelease(name.c_str());
+    }
+    rayTraceProgramCache.clear();
+}
+
 // Create shaders and quad for ray tracing
 void InitRayTracing() {
-    // Compile the ray tracing shader
-    rayTraceProgramID = CompileRayTraceShaders();
+    // Compile the generic ray tracing shader, specialized variants are built on demand
+    rayTraceProgramID = GpuAdoptProgram("rayTrace", CompileRayTraceShaders(""));
+    rayTraceProgramCache[""] = rayTraceProgramID;
+    
+    InitWavefront();
+    InitShadowMaps();
+    
+    // Program that rasterizes the G-buffer of the hybrid mode; it reads the
+    // objects from the SceneBlock like the ray tracer
+    gbufferProgramID = GpuAdoptProgram("gbufferPass", CompileRasterShader(pGBufferVSFileName, pGBufferFSFileName));
+    SetupRayTraceProgram(gbufferProgramID);
+    gbufferWorldLoc = glGetUniformLocation(gbufferProgramID, "gWorld");
+    gbufferViewProjectionLoc = glGetUniformLocation(gbufferProgramID, "viewProjection");
+    gbufferPrimitiveLoc = glGetUniformLocation(gbufferProgramID, "primitive");
     
     // Create the quad for ray tracing
     CreateQuad();
     
+    // Program that shows the cached ray-traced image
+    presentProgramID = GpuAdoptProgram("present", CompileScreenShader(pPresentFSFileName, ""));
+    glUseProgram(presentProgramID);
+    glUniform1i(glGetUniformLocation(presentProgramID, "sourceTexture"), 0);
+    presentSourceSizeLoc = glGetUniformLocation(presentProgramID, "sourceSize");
+    presentSharpnessLoc = glGetUniformLocation(presentProgramID, "edgeSharpness");
+    glUseProgram(0);
+    
+    // Program that fills in the pixels skipped by interlaced tracing
+    reconstructProgramID = GpuAdoptProgram("reconstruct", CompileScreenShader(pReconstructFSFileName, ""));
+    glUseProgram(reconstructProgramID);
+    glUniform1i(glGetUniformLocation(reconstructProgramID, "samplesTexture"), 0);
+    reconstructPhaseCountLoc = glGetUniformLocation(reconstructProgramID, "phaseCount");
+    reconstructCurrentPhaseLoc = glGetUniformLocation(reconstructProgramID, "currentPhase");
+    reconstructValidPhasesLoc = glGetUniformLocation(reconstructProgramID, "validPhases");
+    glUseProgram(0);
+    
+    // Program that marks the tiles adaptive sampling still has to refine
+    sampleMaskProgramID = GpuAdoptProgram("sampleMask", CompileScreenShader(pSampleMaskFSFileName, ""));
+    glUseProgram(sampleMaskProgramID);
+    glUniform1i(glGetUniformLocation(sampleMaskProgramID, "momentsTexture"), 0);
+    sampleMaskTileSizeLoc = glGetUniformLocation(sampleMaskProgramID, "tileSize");
+    sampleMaskThresholdLoc = glGetUniformLocation(sampleMaskProgramID, "threshold");
+    glUseProgram(0);
+    
+    // Programs of the denoiser passes
+    denoiseTemporalProgramID = GpuAdoptProgram("denoiseTemporal", CompileScreenShader(pDenoiseTemporalFSFileName, ""));
+    glUseProgram(denoiseTemporalProgramID);
+    const char* temporalSamplers[8] = { "currentColor", "currentPosition", "currentNormal", "currentAlbedo",
+                                        "historyIllumination", "historyMoments", "previousPosition", "previousNormal" };
+    for (int i = 0; i < 8; i++) {
+        glUniform1i(glGetUniformLocation(denoiseTemporalProgramID, temporalSamplers[i]), i);
+    }
+    denoisePreviousViewProjectionLoc = glGetUniformLocation(denoiseTemporalProgramID, "previousViewProjection");
+    denoiseTemporalEyeLoc = glGetUniformLocation(denoiseTemporalProgramID, "eyePosition");
+    denoiseHistoryValidLoc = glGetUniformLocation(denoiseTemporalProgramID, "historyValid");
+    denoiseColorAlphaLoc = glGetUniformLocation(denoiseTemporalProgramID, "colorAlpha");
+    denoiseMomentsAlphaLoc = glGetUniformLocation(denoiseTemporalProgramID, "momentsAlpha");
+    
+    denoiseAtrousProgramID = GpuAdoptProgram("denoiseAtrous", CompileScreenShader(pDenoiseAtrousFSFileName, ""));
+    glUseProgram(denoiseAtrousProgramID);
+    const char* atrousSamplers[4] = { "illuminationTexture", "positionTexture", "normalTexture", "albedoTexture" };
+    for (int i = 0; i < 4; i++) {
+        glUniform1i(glGetUniformLocation(denoiseAtrousProgramID, atrousSamplers[i]), i);
+    }
+    denoiseStepSizeLoc = glGetUniformLocation(denoiseAtrousProgramID, "stepSize");
+    denoiseAtrousEyeLoc = glGetUniformLocation(denoiseAtrousProgramID, "eyePosition");
+    denoisePixelFootprintLoc = glGetUniformLocation(denoiseAtrousProgramID, "pixelFootprint");
+    denoiseModulateLoc = glGetUniformLocation(denoiseAtrousProgramID, "modulate");
+    glUseProgram(0);
+    
     // Setup the initial scene
-    SetupScene();
+    SetupNamedScene();
 }
 
 /********************************************************************
   Utility functions
  */
 
-/* post: compute frames per second and display in window's title bar */
-void computeFPS()
+/* post: width and height of the default framebuffer, which is the window's
+   or, in headless mode, the offscreen image's */
+void GetFramebufferSize(int *width, int *height)
+{
+	if (headless)
+	{
+		*width = theWindowWidth;
+		*height = theWindowHeight;
+		return;
+	}
+	glfwGetFramebufferSize(glfwGetCurrentContext(), width, height);
+}
+
+/* post: display frames per second and the latest frame times in window's title bar, once per second */
+void UpdateWindowTitle(GLFWwindow *window)
+{
+	static FrameClock::time_point lastUpdate = FrameClock::now();
+	static unsigned int lastFrameCount = 0;
+
+	double elapsed = std::chrono::duration<double>(FrameClock::now() - lastUpdate).count();
+	if (elapsed < 1.0)
+		return;
+	if (frameStats.frameCount < lastFrameCount)  // statistics were reset
+		lastFrameCount = 0;
+
+	char title[128];
+	snprintf(title, sizeof(title), "%s [ FPS: %4.2f | CPU: %.2f ms | GPU: %.2f ms ]",
+			theProgramTitle,
+			(frameStats.frameCount - lastFrameCount) / elapsed,
+			frameStats.lastCpuMs, frameStats.lastGpuMs);
+	glfwSetWindowTitle(window, title);
+	lastUpdate = FrameClock::now();
+	lastFrameCount = frameStats.frameCount;
+}
+
+/* post: write the session's frame statistics next to frameStatsPath */
+void ExportFrameStats()
 {
-	static int frameCount = 0;
-	static int lastFrameTime = 0;
-	static char *title = NULL;
-	int currentTime;
-
-	if (!title)
-		title = (char *)malloc((strlen(theProgramTitle) + 20) * sizeof(char));
-	frameCount++;
-	currentTime = 0;
-	if (currentTime - lastFrameTime > 1000)
+	std::string path = frameStatsPath;
+	if (FrameStatsWriteCsv(frameStats, (path + ".csv").c_str()) &&
+		FrameStatsWriteJson(frameStats, (path + ".json").c_str()))
 	{
-		snprintf(title, strlen(theProgramTitle) + 20,"%s [ FPS: %4.2f ]",
-				theProgramTitle,
-				frameCount * 1000.0 / (currentTime - lastFrameTime));
-		lastFrameTime = currentTime;
-		frameCount = 0;
+		printf("Frame statistics: %u frames, CPU p50/p95/p99 %.2f/%.2f/%.2f ms, %u hitches, written to %s.{csv,json}\n",
+			   frameStats.frameCount,
+			   FrameHistogramPercentile(frameStats.cpu, 0.50),
+			   FrameHistogramPercentile(frameStats.cpu, 0.95),
+			   FrameHistogramPercentile(frameStats.cpu, 0.99),
+			   frameStats.hitchCount, frameStatsPath);
 	}
 }
 
@@ -464,25 +1435,88 @@ static void LoadOffModel() {
         
         // Triangle fan triangulation
         for (int j = 0; j < poly.noSides - 2; j++) {
-            indices[indexCount++] = poly.v[0];         // First vertex
-            indices[indexCount++] = poly.v[j + 1];     // Second vertex
-            indices[indexCount++] = poly.v[j + 2];     // Third vertex
+            int v0Idx = poly.v[0];
+            int v1Idx = poly.v[j + 1];
+            int v2Idx = poly.v[j + 2];
+            
+            // Skip triangles that reference vertices outside the model
+            if (v0Idx < 0 || v0Idx >= model->numberOfVertices ||
+                v1Idx < 0 || v1Idx >= model->numberOfVertices ||
+                v2Idx < 0 || v2Idx >= model->numberOfVertices) continue;
+            
+            indices[indexCount++] = v0Idx;     // First vertex
+            indices[indexCount++] = v1Idx;     // Second vertex
+            indices[indexCount++] = v2Idx;     // Third vertex
+        }
+    }
+    if (indexCount < numIndices) {
+        fprintf(stderr, "Skipped %d triangles with invalid vertex indices\n", (numIndices - indexCount) / 3);
+        numIndices = indexCount;
+    }
+    
+    // Reorder triangles along a Morton curve of their centroids, then renumber
+    // vertices in order of first use so the vertex fetches follow the same curve.
+    // The ray tracer keeps only the first MAX_TRIANGLES triangles (see
+    // PrepareMeshForRayTracing). They are sorted on their own and stored first,
+    // so raster passes that must match the traced scene draw numTracedIndices.
+    int triangleTotal = indexCount / 3;
+    int tracedTotal = std::min(triangleTotal, MAX_TRIANGLES);
+    std::vector<unsigned int> triangleOrder;
+    for (int part = 0; part < 2; part++) {
+        int begin = part == 0 ? 0 : tracedTotal;
+        int end = part == 0 ? tracedTotal : triangleTotal;
+        std::vector<glm::vec3> centroids(end - begin);
+        for (int i = begin; i < end; i++) {
+            const Vector3f& a = vertices[indices[i * 3]];
+            const Vector3f& b = vertices[indices[i * 3 + 1]];
+            const Vector3f& c = vertices[indices[i * 3 + 2]];
+            centroids[i - begin] = glm::vec3(a.x + b.x + c.x, a.y + b.y + c.y, a.z + b.z + c.z) / 3.0f;
+        }
+        std::vector<unsigned int> partOrder;
+        ComputeMortonOrder(centroids, partOrder);
+        for (size_t i = 0; i < partOrder.size(); i++) {
+            triangleOrder.push_back(begin + partOrder[i]);
+        }
+    }
+    numTracedIndices = tracedTotal * 3;
+    
+    std::vector<int> vertexRemap(model->numberOfVertices, -1);
+    Vector3f* sortedVertices = new Vector3f[model->numberOfVertices];
+    unsigned int* sortedIndices = new unsigned int[numIndices];
+    int nextVertex = 0;
+    for (int i = 0; i < triangleTotal; i++) {
+        for (int k = 0; k < 3; k++) {
+            unsigned int oldIndex = indices[triangleOrder[i] * 3 + k];
+            if (vertexRemap[oldIndex] < 0) {
+                vertexRemap[oldIndex] = nextVertex;
+                sortedVertices[nextVertex++] = vertices[oldIndex];
+            }
+            sortedIndices[i * 3 + k] = vertexRemap[oldIndex];
         }
     }
+    // Keep unreferenced vertices at the end so the buffer size is unchanged
+    for (int i = 0; i < model->numberOfVertices; i++) {
+        if (vertexRemap[i] < 0) {
+            vertexRemap[i] = nextVertex;
+            sortedVertices[nextVertex++] = vertices[i];
+        }
+    }
+    delete[] vertices;
+    delete[] indices;
+    vertices = sortedVertices;
+    indices = sortedIndices;
     
     // Create and bind a vertex array object
-    glGenVertexArrays(1, &VAO);
+    VAO = GpuVertexArray("meshVAO");
     glBindVertexArray(VAO);
     
     // Create and populate the vertex buffer object
-    glGenBuffers(1, &VBO);
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, model->numberOfVertices * sizeof(Vector3f), vertices, GL_STATIC_DRAW);
+    VBO = GpuBufferData("meshVertices", GL_ARRAY_BUFFER,
+                        model->numberOfVertices * sizeof(Vector3f), vertices, GL_STATIC_DRAW);
     
     // Create and populate the index buffer object
-    glGenBuffers(1, &IBO);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, IBO);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, numIndices * sizeof(unsigned int), indices, GL_STATIC_DRAW);
+    IBO = GpuBufferData("meshIndices", GL_ELEMENT_ARRAY_BUFFER,
+                        numIndices * sizeof(unsigned int), indices, GL_STATIC_DRAW);
     
     // Set up vertex attributes
     glEnableVertexAttribArray(0);
@@ -535,6 +1569,8 @@ static void AddShader(GLuint ShaderProgram, const char *pShaderText, GLenum Shad
 	}
 
 	glAttachShader(ShaderProgram, ShaderObj);
+	// The shader object is freed together with the program it is attached to
+	glDeleteShader(ShaderObj);
 }
 
 using namespace std;
@@ -561,19 +1597,26 @@ static void CompileShaders()
 		exit(1);
 	}
 
-	AddShader(ShaderProgram, vs.c_str(), GL_VERTEX_SHADER);
-	AddShader(ShaderProgram, fs.c_str(), GL_FRAGMENT_SHADER);
-
 	GLint Success = 0;
 	GLchar ErrorLog[1024] = {0};
 
-	glLinkProgram(ShaderProgram);
-	glGetProgramiv(ShaderProgram, GL_LINK_STATUS, &Success);
-	if (Success == 0)
+	// Reuse the program binary from a previous run if there is one
+	string cacheKey = ShaderCacheKey(vs, fs);
+	if (!ShaderCacheLoad(ShaderProgram, cacheKey))
 	{
-		glGetProgramInfoLog(ShaderProgram, sizeof(ErrorLog), NULL, ErrorLog);
-		fprintf(stderr, "Error linking shader program: '%s'\n", ErrorLog);
-		exit(1);
+		AddShader(ShaderProgram, vs.c_str(), GL_VERTEX_SHADER);
+		AddShader(ShaderProgram, fs.c_str(), GL_FRAGMENT_SHADER);
+
+		ShaderCachePrepare(ShaderProgram);
+		glLinkProgram(ShaderProgram);
+		glGetProgramiv(ShaderProgram, GL_LINK_STATUS, &Success);
+		if (Success == 0)
+		{
+			glGetProgramInfoLog(ShaderProgram, sizeof(ErrorLog), NULL, ErrorLog);
+			fprintf(stderr, "Error linking shader program: '%s'\n", ErrorLog);
+			exit(1);
+		}
+		ShaderCacheStore(ShaderProgram, cacheKey);
 	}
 	glBindVertexArray(VAO);
 	glValidateProgram(ShaderProgram);
@@ -585,6 +1628,7 @@ static void CompileShaders()
 		exit(1);
 	}
 
+	rasterProgramID = GpuAdoptProgram("raster", ShaderProgram);
 	glUseProgram(ShaderProgram);
 	gWorldLocation = glGetUniformLocation(ShaderProgram, "gWorld");
 	gViewLocation = glGetUniformLocation(ShaderProgram, "gView");
@@ -607,125 +1651,930 @@ void onInit(int argc, char *argv[])
 	glEnable(GL_DEPTH_TEST);
 }
 
-void RenderRayTracing() {
-    glUseProgram(rayTraceProgramID);
+// Function to compute the camera-to-world ray basis for a width x height target.
+// The shader only needs one multiply-add per axis to get a pixel's ray direction.
+CameraBlockData ComputeCameraBlock(int width, int height) {
+    glm::vec3 forward = glm::normalize(cameraTarget - cameraPosition);
+    glm::vec3 right = glm::normalize(glm::cross(forward, cameraUp));
+    glm::vec3 up = glm::cross(right, forward);
     
-    // Set uniform variables for the ray tracer
+    float tanHalfY = tan(glm::radians(cameraFOV) * 0.5f);
+    float tanHalfX = tanHalfY * (float)width / (float)height;
     
-    // Camera parameters
-    GLint cameraPositionLoc = glGetUniformLocation(rayTraceProgramID, "cameraPosition");
-    glUniform3fv(cameraPositionLoc, 1, glm::value_ptr(cameraPosition));
+    CameraBlockData camera = CameraBlockData();
+    camera.cameraPosition = cameraPosition;
+    camera.pixelDeltaX = right * (2.0f * tanHalfX / (float)width);
+    camera.pixelDeltaY = up * (2.0f * tanHalfY / (float)height);
+    camera.rayBase = forward - right * tanHalfX - up * tanHalfY;
+    camera.screenSize = glm::vec2((float)width, (float)height);
+    return camera;
+}
+
+// Function to compute the view-projection matrix matching the ray basis of
+// ComputeCameraBlock, used to reproject world positions into a traced image
+glm::mat4 ComputeViewProjection(int width, int height) {
+    glm::mat4 projection = glm::perspective(glm::radians(cameraFOV), (float)width / (float)height, 0.1f, 100.0f);
+    return projection * glm::lookAt(cameraPosition, cameraTarget, cameraUp);
+}
+
+// Function to rasterize the primary visibility of a width x height image into
+// the G-buffer, with primitives identified by their slot in order. Draws only if
+// dirty or the G-buffer was reallocated, keeping the bound framebuffer and
+// viewport. Returns true if the G-buffer was reallocated.
+bool UpdateGBuffer(int width, int height, const PrimitiveOrder& order, bool dirty) {
+    GLint previousFramebuffer, previousViewport[4];
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+    glGetIntegerv(GL_VIEWPORT, previousViewport);
     
-    // View and projection matrices
-    glm::mat4 viewMatrix = glm::lookAt(cameraPosition, cameraTarget, cameraUp);
-    GLint viewMatrixLoc = glGetUniformLocation(rayTraceProgramID, "viewMatrix");
-    glUniformMatrix4fv(viewMatrixLoc, 1, GL_FALSE, glm::value_ptr(viewMatrix));
+    const GLenum formats[2] = { GL_RGBA32F, GL_RGBA16F };
+    bool reallocated = GpuRenderTargets("gbuffer", 2, formats, width, height, gbufferTextures);
+    if (reallocated) {
+        GLuint depthTexture = GpuTexImage2D("gbufferDepth", GL_DEPTH_COMPONENT24, width, height,
+                                            GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTexture, 0);
+    }
     
-    // We need the projection matrix for proper ray direction calculation
-    int width, height;
-    glfwGetFramebufferSize(glfwGetCurrentContext(), &width, &height);
-    float aspectRatio = (float)width / (float)height;
-    glm::mat4 projectionMatrix = glm::perspective(glm::radians(cameraFOV), aspectRatio, 0.1f, 100.0f);
-    GLint projectionMatrixLoc = glGetUniformLocation(rayTraceProgramID, "projectionMatrix");
-    glUniformMatrix4fv(projectionMatrixLoc, 1, GL_FALSE, glm::value_ptr(projectionMatrix));
-    
-    // Screen dimensions
-    GLint screenWidthLoc = glGetUniformLocation(rayTraceProgramID, "screenWidth");
-    GLint screenHeightLoc = glGetUniformLocation(rayTraceProgramID, "screenHeight");
-    glUniform1f(screenWidthLoc, (float)width);
-    glUniform1f(screenHeightLoc, (float)height);
-    
-    // Ray tracing settings
-    GLint enableShadowsLoc = glGetUniformLocation(rayTraceProgramID, "enableShadows");
-    GLint enableReflectionsLoc = glGetUniformLocation(rayTraceProgramID, "enableReflections");
-    GLint maxBouncesLoc = glGetUniformLocation(rayTraceProgramID, "maxBounces");
-    GLint reflectivityLoc = glGetUniformLocation(rayTraceProgramID, "reflectivity");
-    glUniform1i(enableShadowsLoc, enableShadows ? 1 : 0);
-    glUniform1i(enableReflectionsLoc, enableReflections ? 1 : 0);
-    glUniform1i(maxBouncesLoc, maxBounces);
-    glUniform1f(reflectivityLoc, reflectivity);
-    
-    // Set scene objects
-    GLint numObjectsLoc = glGetUniformLocation(rayTraceProgramID, "numObjects");
-    glUniform1i(numObjectsLoc, numObjects);
-    
-    for (int i = 0; i < numObjects; i++) {
-        char buffer[64];
+    if (reallocated || dirty) {
+        GLboolean depthTest = glIsEnabled(GL_DEPTH_TEST);
+        glViewport(0, 0, width, height);
+        glEnable(GL_DEPTH_TEST);
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         
-        snprintf(buffer, sizeof(buffer), "objects[%d].type", i);
-        GLint typeLoc = glGetUniformLocation(rayTraceProgramID, buffer);
-        
-        snprintf(buffer, sizeof(buffer), "objects[%d].position", i);
-        GLint posLoc = glGetUniformLocation(rayTraceProgramID, buffer);
-        
-        snprintf(buffer, sizeof(buffer), "objects[%d].size", i);
-        GLint sizeLoc = glGetUniformLocation(rayTraceProgramID, buffer);
-        
-        snprintf(buffer, sizeof(buffer), "objects[%d].color", i);
-        GLint colorLoc = glGetUniformLocation(rayTraceProgramID, buffer);
-        
-        snprintf(buffer, sizeof(buffer), "objects[%d].reflectivity", i);
-        GLint reflLoc = glGetUniformLocation(rayTraceProgramID, buffer);
-        
-        glUniform1i(typeLoc, sceneObjects[i].type);
-        glUniform3fv(posLoc, 1, glm::value_ptr(sceneObjects[i].position));
-        glUniform3fv(sizeLoc, 1, glm::value_ptr(sceneObjects[i].size));
-        glUniform3fv(colorLoc, 1, glm::value_ptr(sceneObjects[i].color));
-        glUniform1f(reflLoc, sceneObjects[i].reflectivity);
+        glm::mat4 viewProjection = ComputeViewProjection(width, height);
+        glUseProgram(gbufferProgramID);
+        glUniformMatrix4fv(gbufferViewProjectionLoc, 1, GL_FALSE, glm::value_ptr(viewProjection));
+        DrawRasterObjects(gbufferWorldLoc, gbufferPrimitiveLoc, &order, true);
+        if (!depthTest) glDisable(GL_DEPTH_TEST);
     }
     
-    // Set lights
-    GLint numLightsLoc = glGetUniformLocation(rayTraceProgramID, "numLights");
-    glUniform1i(numLightsLoc, numLights);
+    glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+    glViewport(previousViewport[0], previousViewport[1], previousViewport[2], previousViewport[3]);
+    return reallocated;
+}
+
+// Function to return the light cluster depth slice of a view depth, the same
+// mapping as lightClusterRange in rt_common.glsl
+int LightClusterSlice(float depth) {
+    float slice = log(glm::max(depth, 1e-4f) / LIGHT_CLUSTER_NEAR) / log(LIGHT_CLUSTER_FAR / LIGHT_CLUSTER_NEAR);
+    return glm::clamp((int)floor(slice * LIGHT_CLUSTER_SLICES), 0, LIGHT_CLUSTER_SLICES - 1);
+}
+
+// Function to bin the lights into the clusters of a width x height image. The
+// result starts with an (offset, count) pair per cluster, followed by the
+// light lists the offsets point to. A light goes into every cluster its
+// bounding box overlaps on screen and in depth; unbounded lights and lights
+// reaching behind the camera cover the whole screen.
+void BuildLightClusters(int width, int height, std::vector<int>& clusters) {
+    int tilesX = (width + LIGHT_CLUSTER_TILE_SIZE - 1) / LIGHT_CLUSTER_TILE_SIZE;
+    int tilesY = (height + LIGHT_CLUSTER_TILE_SIZE - 1) / LIGHT_CLUSTER_TILE_SIZE;
+    int clusterCount = tilesX * tilesY * LIGHT_CLUSTER_SLICES;
+    glm::mat4 viewProjection = ComputeViewProjection(width, height);
+    glm::vec3 forward = glm::normalize(cameraTarget - cameraPosition);
     
-    for (int i = 0; i < numLights; i++) {
-        char buffer[64];
-        
-        snprintf(buffer, sizeof(buffer), "lights[%d].position", i);
-        GLint posLoc = glGetUniformLocation(rayTraceProgramID, buffer);
+    // Cluster box of each light: tiles x0..x1, y0..y1, slices z0..z1
+    std::vector<int> boxes(lights.size() * 6);
+    std::vector<int> counts(clusterCount, 0);
+    for (size_t i = 0; i < lights.size(); i++) {
+        int* box = &boxes[i * 6];
+        box[0] = 0; box[1] = tilesX - 1;
+        box[2] = 0; box[3] = tilesY - 1;
+        box[4] = 0; box[5] = LIGHT_CLUSTER_SLICES - 1;
         
-        snprintf(buffer, sizeof(buffer), "lights[%d].color", i);
-        GLint colorLoc = glGetUniformLocation(rayTraceProgramID, buffer);
-        
-        snprintf(buffer, sizeof(buffer), "lights[%d].intensity", i);
-        GLint intensityLoc = glGetUniformLocation(rayTraceProgramID, buffer);
+        const Light& light = lights[i];
+        if (light.range > 0.0f) {
+            float depth = glm::dot(light.position - cameraPosition, forward);
+            if (depth + light.range < 0.0f) {
+                box[1] = -1;    // Entirely behind the camera
+                continue;
+            }
+            box[4] = LightClusterSlice(depth - light.range);
+            box[5] = LightClusterSlice(depth + light.range);
+            
+            // Corners of the bounding cube are up to sqrt(3) * range closer
+            if (depth - 1.7321f * light.range > 0.1f) {
+                glm::vec2 lo(1e30f), hi(-1e30f);
+                for (int corner = 0; corner < 8; corner++) {
+                    glm::vec3 offset((corner & 1) ? light.range : -light.range,
+                                     (corner & 2) ? light.range : -light.range,
+                                     (corner & 4) ? light.range : -light.range);
+                    glm::vec4 clip = viewProjection * glm::vec4(light.position + offset, 1.0f);
+                    glm::vec2 pixel((clip.x / clip.w * 0.5f + 0.5f) * width, (clip.y / clip.w * 0.5f + 0.5f) * height);
+                    lo = glm::min(lo, pixel);
+                    hi = glm::max(hi, pixel);
+                }
+                box[0] = glm::max(0, (int)floor(lo.x / LIGHT_CLUSTER_TILE_SIZE));
+                box[1] = glm::min(tilesX - 1, (int)floor(hi.x / LIGHT_CLUSTER_TILE_SIZE));
+                box[2] = glm::max(0, (int)floor(lo.y / LIGHT_CLUSTER_TILE_SIZE));
+                box[3] = glm::min(tilesY - 1, (int)floor(hi.y / LIGHT_CLUSTER_TILE_SIZE));
+            }
+        }
         
-        glUniform3fv(posLoc, 1, glm::value_ptr(lights[i].position));
-        glUniform3fv(colorLoc, 1, glm::value_ptr(lights[i].color));
-        glUniform1f(intensityLoc, lights[i].intensity);
+        for (int z = box[4]; z <= box[5]; z++)
+            for (int y = box[2]; y <= box[3]; y++)
+                for (int x = box[0]; x <= box[1]; x++)
+                    counts[(z * tilesY + y) * tilesX + x]++;
     }
     
-    // Set ambient light
-    GLint ambientLightLoc = glGetUniformLocation(rayTraceProgramID, "ambientLight");
-    glUniform3fv(ambientLightLoc, 1, glm::value_ptr(ambientLight));
+    // Offsets of the light lists, then the lists themselves
+    clusters.assign(clusterCount * 2, 0);
+    int total = clusterCount * 2;
+    int nonEmpty = 0;
+    lightClusterMax = 0;
+    for (int c = 0; c < clusterCount; c++) {
+        clusters[c * 2] = total;
+        total += counts[c];
+        nonEmpty += counts[c] > 0 ? 1 : 0;
+        lightClusterMax = glm::max(lightClusterMax, counts[c]);
+    }
+    lightClusterAverage = nonEmpty > 0 ? (float)(total - clusterCount * 2) / nonEmpty : 0.0f;
     
-    // Bind the mesh data texture
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, meshDataTexture);
-    GLint meshDataTextureLoc = glGetUniformLocation(rayTraceProgramID, "meshDataTexture");
-    glUniform1i(meshDataTextureLoc, 0);
-    
-    // Pass mesh information
-    GLint numTrianglesLoc = glGetUniformLocation(rayTraceProgramID, "numTriangles");
-    GLint meshObjectIndexLoc = glGetUniformLocation(rayTraceProgramID, "meshObjectIndex");
-    GLint meshTextureSizeLoc = glGetUniformLocation(rayTraceProgramID, "meshTextureSize");
-    glUniform1i(numTrianglesLoc, numTriangles);
-    glUniform1i(meshObjectIndexLoc, meshObjectIndex);
-    glUniform1i(meshTextureSizeLoc, meshTextureSize / 4); // Size in texels
-    
-    // Render the quad
-    glBindVertexArray(quadVAO);
-    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-    glBindVertexArray(0);
-}
-
+    clusters.resize(total);
+    for (size_t i = 0; i < lights.size(); i++) {
+        const int* box = &boxes[i * 6];
+        for (int z = box[4]; z <= box[5]; z++) {
+            for (int y = box[2]; y <= box[3]; y++) {
+                for (int x = box[0]; x <= box[1]; x++) {
+                    int c = (z * tilesY + y) * tilesX + x;
+                    clusters[clusters[c * 2] + clusters[c * 2 + 1]++] = (int)i;
+                }
+            }
+        }
+    }
+}
+
+// What UpdateRayTraceInputs found changed since its previous call
+enum RayTraceChange {
+    RAY_TRACE_CAMERA_CHANGED = 1,    // Only the view, previous images can be reprojected
+    RAY_TRACE_SCENE_CHANGED = 2      // Anything else that affects the image
+};
+
+// Function to upload the ray tracing inputs for a width x height image and
+// select the program. Returns the RayTraceChange flags of what changed since
+// the previous call, 0 if the image would be the same.
+int UpdateRayTraceInputs(int width, int height) {
+    bool changed = sceneDirty;
+    shadowMapsDirty |= sceneDirty;
+    sceneDirty = false;
+    int shadowMapLights = useShadowMaps && enableShadows ? glm::min((int)lights.size(), MAX_SHADOW_MAP_LIGHTS) : 0;
+    
+    rayTraceProgramID = SelectRayTraceProgram();
+    changed |= rayTraceProgramID != lastRayTraceProgramID;
+    lastRayTraceProgramID = rayTraceProgramID;
+    
+    // Camera ray generation basis
+    CameraBlockData camera = ComputeCameraBlock(width, height);
+    bool cameraChanged = UpdateUniformBlock("cameraBlock", CAMERA_BLOCK_BINDING, &camera, sizeof(camera), uploadedCameraBlock);
+    
+    // Settings
+    SettingsBlockData settings = SettingsBlockData();
+    settings.reflectivity = reflectivity;
+    settings.shadowsEnabled = enableShadows ? 1 : 0;
+    settings.reflectionsEnabled = enableReflections ? 1 : 0;
+    settings.bounceLimit = maxBounces;
+    settings.softShadows = softShadowMode >= 0 ? softShadowMode
+                         : (frameMode == FRAME_MODE_PROGRESSIVE || frameMode == FRAME_MODE_DENOISED ? 1 : 0);
+    settings.shadowMapLights = shadowMapLights;
+    settings.hybridPrimary = useHybridPrimary ? 1 : 0;
+    settings.roughness = glossyRoughness;
+    changed |= UpdateUniformBlock("settingsBlock", SETTINGS_BLOCK_BINDING, &settings, sizeof(settings), uploadedSettingsBlock);
+    
+    // Primitives of each type in traversal order, followed by the mesh information
+    PrimitiveOrder primitiveOrder;
+    ComputePrimitiveOrder(primitiveOrder);
+    
+    SceneBlockData scene = SceneBlockData();
+    scene.sphereCount = (int)spheres.size();
+    for (int slot = 0; slot < scene.sphereCount; slot++) {
+        const SpherePrimitive& sphere = spheres[primitiveOrder.spheres[slot]];
+        scene.sphereGeometry[slot] = glm::vec4(sphere.center, sphere.radius);
+        scene.sphereMaterial[slot] = glm::vec4(sphere.color, sphere.reflectivity);
+    }
+    scene.boxCount = (int)boxes.size();
+    for (int slot = 0; slot < scene.boxCount; slot++) {
+        const BoxPrimitive& box = boxes[primitiveOrder.boxes[slot]];
+        scene.boxMin[slot] = glm::vec4(box.center - box.halfSize, 0.0f);
+        scene.boxMax[slot] = glm::vec4(box.center + box.halfSize, 0.0f);
+        scene.boxMaterial[slot] = glm::vec4(box.color, box.reflectivity);
+    }
+    scene.meshInstanceCount = model ? (int)meshInstances.size() : 0;
+    for (int slot = 0; slot < scene.meshInstanceCount; slot++) {
+        const MeshInstance& instance = meshInstances[primitiveOrder.meshInstances[slot]];
+        scene.meshOffset[slot] = glm::vec4(instance.position, 0.0f);
+        scene.meshBoundsMin[slot] = glm::vec4(instance.position + meshBoundsMin, 0.0f);
+        scene.meshBoundsMax[slot] = glm::vec4(instance.position + meshBoundsMax, 0.0f);
+        scene.meshMaterial[slot] = glm::vec4(instance.color, instance.reflectivity);
+    }
+    scene.numTriangles = numTriangles;
+    scene.meshTextureSize = meshTextureSize / 4; // Size in texels
+    changed |= UpdateUniformBlock("sceneBlock", SCENE_BLOCK_BINDING, &scene, sizeof(scene), uploadedSceneBlock);
+    
+    // Lights, three texels each, and their hierarchy go to texture buffers.
+    // The tree is only rebuilt when a light changed. Both hold at least one texel.
+    std::vector<glm::vec4> lightTexels(std::max<size_t>(1, lights.size() * 3), glm::vec4(0.0f));
+    for (size_t i = 0; i < lights.size(); i++) {
+        lightTexels[i * 3] = glm::vec4(lights[i].position, lights[i].intensity);
+        lightTexels[i * 3 + 1] = glm::vec4(lights[i].color, lights[i].radius);
+        lightTexels[i * 3 + 2] = glm::vec4(lights[i].range, 0.0f, 0.0f, 0.0f);
+    }
+    bool lightsChanged = UpdateTextureBuffer("lightData", GL_RGBA32F, &lightTexels[0], lightTexels.size() * sizeof(glm::vec4),
+                                             uploadedLightData, &lightDataTexture);
+    if (lightsChanged) {
+        std::vector<LightTreeItem> items(lights.size());
+        for (size_t i = 0; i < lights.size(); i++) {
+            items[i].boundsMin = lights[i].position - glm::vec3(lights[i].radius);
+            items[i].boundsMax = lights[i].position + glm::vec3(lights[i].radius);
+            items[i].energy = lights[i].intensity * glm::dot(lights[i].color, glm::vec3(0.299f, 0.587f, 0.114f)) + 1e-6f;
+            items[i].range = lights[i].range;
+            items[i].index = (int)i;
+        }
+        std::vector<LightTreeNode> nodes;
+        BuildLightTree(items, nodes);
+        lightTreeNodeCount = (int)nodes.size();
+        
+        std::vector<glm::vec4> treeTexels(std::max<size_t>(1, nodes.size() * 3), glm::vec4(0.0f));
+        if (!nodes.empty()) {
+            memcpy((void*)&treeTexels[0], &nodes[0], nodes.size() * sizeof(LightTreeNode));
+        }
+        UpdateTextureBuffer("lightTree", GL_RGBA32F, &treeTexels[0], treeTexels.size() * sizeof(glm::vec4),
+                            uploadedLightTree, &lightTreeTexture);
+        changed = true;
+    }
+    
+    // Light clusters follow the camera and the lights. They only affect the
+    // image through which lights get shadow rays, so they do not count as a change.
+    if (lightCulling && (lightsChanged || cameraChanged || uploadedLightClusters.empty())) {
+        std::vector<int> clusters;
+        BuildLightClusters(width, height, clusters);
+        UpdateTextureBuffer("lightClusters", GL_R32I, &clusters[0], clusters.size() * sizeof(int),
+                            uploadedLightClusters, &lightClusterTexture);
+    } else if (!lightCulling) {
+        uploadedLightClusters.clear();
+    }
+    
+    // Shadow maps follow the placement of the primitives and lights, not
+    // their traversal order or colors
+    std::vector<float> signature;
+    signature.push_back((float)spheres.size());
+    for (size_t i = 0; i < spheres.size(); i++) {
+        float values[4] = { spheres[i].center.x, spheres[i].center.y, spheres[i].center.z, spheres[i].radius };
+        signature.insert(signature.end(), values, values + 4);
+    }
+    signature.push_back((float)boxes.size());
+    for (size_t i = 0; i < boxes.size(); i++) {
+        signature.insert(signature.end(), glm::value_ptr(boxes[i].center), glm::value_ptr(boxes[i].center) + 3);
+        signature.insert(signature.end(), glm::value_ptr(boxes[i].halfSize), glm::value_ptr(boxes[i].halfSize) + 3);
+    }
+    for (size_t i = 0; i < meshInstances.size(); i++) {
+        signature.insert(signature.end(), glm::value_ptr(meshInstances[i].position), glm::value_ptr(meshInstances[i].position) + 3);
+    }
+    for (int i = 0; i < shadowMapLights; i++) {
+        signature.insert(signature.end(), glm::value_ptr(lights[i].position), glm::value_ptr(lights[i].position) + 3);
+    }
+    shadowMapsDirty |= signature != shadowMapSignature;
+    shadowMapSignature.swap(signature);
+    changed |= UpdateShadowMaps(shadowMapLights);
+    
+    LightBlockData lightBlock = LightBlockData();
+    lightBlock.ambientLight = ambientLight;
+    lightBlock.lightCount = (int)lights.size();
+    lightBlock.lightSamples = lightSamplesPerHit;
+    lightBlock.lightCulling = lightCulling ? 1 : 0;
+    lightBlock.clusterTileSize = LIGHT_CLUSTER_TILE_SIZE;
+    lightBlock.clusterSlices = LIGHT_CLUSTER_SLICES;
+    lightBlock.clusterTilesX = (width + LIGHT_CLUSTER_TILE_SIZE - 1) / LIGHT_CLUSTER_TILE_SIZE;
+    lightBlock.clusterTilesY = (height + LIGHT_CLUSTER_TILE_SIZE - 1) / LIGHT_CLUSTER_TILE_SIZE;
+    lightBlock.clusterNear = LIGHT_CLUSTER_NEAR;
+    lightBlock.clusterFar = LIGHT_CLUSTER_FAR;
+    changed |= UpdateUniformBlock("lightBlock", LIGHT_BLOCK_BINDING, &lightBlock, sizeof(lightBlock), uploadedLightBlock);
+    
+    if (useHybridPrimary) {
+        changed |= UpdateGBuffer(width, height, primitiveOrder, changed || cameraChanged);
+    }
+    
+    return (cameraChanged ? RAY_TRACE_CAMERA_CHANGED : 0) | (changed ? RAY_TRACE_SCENE_CHANGED : 0);
+}
+
+// Function to bind the scene data textures read by rt_common.glsl
+void BindSceneTextures() {
+    glActiveTexture(GL_TEXTURE6);
+    glBindTexture(GL_TEXTURE_BUFFER, lightDataTexture);
+    glActiveTexture(GL_TEXTURE7);
+    glBindTexture(GL_TEXTURE_BUFFER, lightTreeTexture);
+    glActiveTexture(GL_TEXTURE8);
+    glBindTexture(GL_TEXTURE_BUFFER, lightCulling ? lightClusterTexture : 0);
+    glActiveTexture(GL_TEXTURE9);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, useShadowMaps ? shadowMapTexture : 0);
+    glActiveTexture(GL_TEXTURE10);
+    glBindTexture(GL_TEXTURE_2D, useHybridPrimary ? gbufferTextures[0] : 0);
+    glActiveTexture(GL_TEXTURE11);
+    glBindTexture(GL_TEXTURE_2D, useHybridPrimary ? gbufferTextures[1] : 0);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, meshDataTexture);
+}
+
+// What a ray tracing pass does beyond tracing one sample per pixel
+struct RayTracePass {
+    int sample;                  // Sample index, 0 starts a new image
+    GLuint historyTexture;       // Running average and moments later samples are added to
+    GLuint historyMoments;
+    GLuint sampleMask;           // Adaptive sampling mask, 0 samples every pixel
+    bool reproject;              // Reuse the latest temporal frame where possible
+    int interlacePhase;          // Only trace this phase of interlacePhaseCount, -1 for all pixels
+    int interlacePhaseCount;
+    int seed;                    // Varies the random numbers between passes of the same sample
+    
+    RayTracePass() : sample(0), historyTexture(0), historyMoments(0), sampleMask(0), reproject(false),
+                     interlacePhase(-1), interlacePhaseCount(1), seed(0) {}
+};
+
+// Function to draw the ray tracing quad into the bound framebuffer
+void DrawRayTracePass(int width, int height, const RayTracePass& pass = RayTracePass()) {
+    const RayTraceLocations& locations = rayTraceLocations[rayTraceProgramID];
+    glUseProgram(rayTraceProgramID);
+    glUniform1i(locations.sampleIndex, pass.sample);
+    glUniform1i(locations.randomSeed, pass.seed);
+    glUniform1i(locations.interlacePhases, pass.interlacePhase >= 0 ? pass.interlacePhaseCount : 1);
+    glUniform1i(locations.interlacePhase, pass.interlacePhase);
+    glUniform1i(locations.adaptiveSampling, pass.sampleMask != 0 ? 1 : 0);
+    glUniform1i(locations.maskTileSize, adaptiveTileSize);
+    glActiveTexture(GL_TEXTURE4);
+    glBindTexture(GL_TEXTURE_2D, pass.historyMoments);
+    glActiveTexture(GL_TEXTURE5);
+    glBindTexture(GL_TEXTURE_2D, pass.sampleMask);
+    glUniform1i(locations.temporalEnabled, pass.reproject ? 1 : 0);
+    if (pass.reproject) {
+        glUniform1i(locations.temporalFrame, temporalFrame);
+        glUniform1i(locations.temporalRefreshPeriod, temporalRefreshPeriod);
+        glUniformMatrix4fv(locations.previousViewProjection, 1, GL_FALSE, glm::value_ptr(temporalViewProjection));
+        glActiveTexture(GL_TEXTURE2);
+        glBindTexture(GL_TEXTURE_2D, temporalTextures[temporalCurrent][0]);
+        glActiveTexture(GL_TEXTURE3);
+        glBindTexture(GL_TEXTURE_2D, temporalTextures[temporalCurrent][1]);
+    }
+    
+    // Bind the history and scene textures
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, pass.historyTexture);
+    BindSceneTextures();
+    
+    // Render the quad into the offscreen target
+    glViewport(0, 0, width, height);
+    glBindVertexArray(quadVAO);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    glBindVertexArray(0);
+}
+
+// Function to run one wavefront stage. Stages that work on a queue take their
+// group count from the arguments the PREPARE stages wrote at indirectOffset.
+void DispatchWavefrontStage(WavefrontStage stage, int queueIndex, int bounce, GLuint groups, GLintptr indirectOffset = -1) {
+    glUseProgram(wavefrontPrograms[stage]);
+    glUniform1i(wavefrontQueueIndexLocs[stage], queueIndex);
+    glUniform1i(wavefrontBounceLocs[stage], bounce);
+    if (indirectOffset >= 0) {
+        glDispatchComputeIndirect(indirectOffset);
+    } else {
+        glDispatchCompute(groups, 1, 1);
+    }
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+}
+
+// Function to trace a width x height image into rayTraceTargetTexture with the
+// wavefront stages. Queue sizes stay on the GPU: each bounce only processes the
+// paths the previous SHADE stage compacted into its queue.
+void DrawWavefrontPass(int width, int height) {
+    size_t pathCount = (size_t)width * height;
+    GLuint counters = GpuBufferData("wavefrontCounters", GL_SHADER_STORAGE_BUFFER, 9 * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+    GLuint paths = GpuBufferData("wavefrontPaths", GL_SHADER_STORAGE_BUFFER, pathCount * 80, NULL, GL_DYNAMIC_COPY);
+    GLuint hits = GpuBufferData("wavefrontHits", GL_SHADER_STORAGE_BUFFER, pathCount * 48, NULL, GL_DYNAMIC_COPY);
+    GLuint queues = GpuBufferData("wavefrontQueues", GL_SHADER_STORAGE_BUFFER, pathCount * 2 * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+    size_t shadowRaysPerPath = glm::max(1, LightRaysPerHit());
+    GLuint shadowRays = GpuBufferData("wavefrontShadowRays", GL_SHADER_STORAGE_BUFFER, pathCount * shadowRaysPerPath * 48, NULL, GL_DYNAMIC_COPY);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, counters);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, paths);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, hits);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, queues);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, shadowRays);
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, counters);
+    
+    BindSceneTextures();
+    glBindImageTexture(0, rayTraceTargetTexture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+    
+    GLuint pathGroups = (GLuint)((pathCount + WAVEFRONT_GROUP_SIZE - 1) / WAVEFRONT_GROUP_SIZE);
+    DispatchWavefrontStage(WAVEFRONT_GENERATE, 0, 0, pathGroups);
+    
+    int bounces = enableReflections ? maxBounces : 0;
+    for (int bounce = 0; bounce <= bounces; bounce++) {
+        int queue = bounce % 2;
+        DispatchWavefrontStage(WAVEFRONT_PREPARE_EXTEND, queue, bounce, 1);
+        DispatchWavefrontStage(WAVEFRONT_EXTEND, queue, bounce, 0, WAVEFRONT_QUEUE_DISPATCH_OFFSET);
+        DispatchWavefrontStage(WAVEFRONT_SHADE, queue, bounce, 0, WAVEFRONT_QUEUE_DISPATCH_OFFSET);
+        if (enableShadows) {
+            DispatchWavefrontStage(WAVEFRONT_PREPARE_SHADOW, queue, bounce, 1);
+            DispatchWavefrontStage(WAVEFRONT_SHADOW, queue, bounce, 0, WAVEFRONT_SHADOW_DISPATCH_OFFSET);
+            DispatchWavefrontStage(WAVEFRONT_ACCUMULATE, queue, bounce, 0, WAVEFRONT_QUEUE_DISPATCH_OFFSET);
+        }
+    }
+    
+    DispatchWavefrontStage(WAVEFRONT_RESOLVE, 0, 0, pathGroups);
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+}
+
+// Function to adapt renderScale to a new GPU time measurement of the ray
+// tracing pass. GPU time grows with the pixel count, so the error is taken
+// relative to the target and the scale follows a PI law with anti-windup.
+void UpdateDynamicResolution(double gpuMs) {
+    float error = (float)((targetFrameMs - gpuMs) / targetFrameMs);
+    error = glm::clamp(error, -1.0f, 1.0f);
+    
+    // Anti-windup: the integral term alone never leaves the scale bounds
+    resolutionIntegral = glm::clamp(resolutionIntegral + error,
+                                    minRenderScale / resolutionKi, maxRenderScale / resolutionKi);
+    float scale = resolutionKp * error + resolutionKi * resolutionIntegral;
+    
+    // Quantize so small fluctuations do not reallocate the targets every frame
+    scale = glm::clamp(scale, minRenderScale, maxRenderScale);
+    renderScale = floor(scale * 32.0f + 0.5f) / 32.0f;
+}
+
+// Function to restart the resolution controller at scale, clamped to the
+// current bounds, e.g. after the bounds changed or it was re-enabled
+void ResetDynamicResolution(float scale) {
+    renderScale = glm::clamp(scale, minRenderScale, maxRenderScale);
+    resolutionIntegral = renderScale / resolutionKi;
+}
+
+// Function to pick how many tiles to trace per frame from the measured GPU
+// time of one tile, so a frame stays within tileBudgetMs
+void UpdateTileBudget(double msPerTile) {
+    tileCostMs = msPerTile;
+    int tiles = msPerTile > 0.0 ? (int)(tileBudgetMs / msPerTile) : tileCount;
+    tilesPerFrame = glm::clamp(tiles, 1, glm::max(1, tileCount));
+}
+
+// Function to trace the next tiles of the image in progress into the bound
+// framebuffer, top row first. Each tile is the fullscreen pass clipped by the
+// scissor, so its pixels are identical to a full-frame trace.
+void DrawRayTraceTiles(int width, int height) {
+    int tilesX = (width + tileSize - 1) / tileSize;
+    int count = glm::min(tilesPerFrame, tileCount - tileNext);
+    
+    glEnable(GL_SCISSOR_TEST);
+    bool timed = GpuTimerBegin(rayTraceTimer);
+    for (int i = 0; i < count; i++) {
+        int tile = tileNext + i;
+        int x = (tile % tilesX) * tileSize;
+        int y = height - (tile / tilesX + 1) * tileSize;
+        glScissor(x, glm::max(0, y), tileSize, tileSize + glm::min(0, y));
+        DrawRayTracePass(width, height);
+    }
+    if (timed) GpuTimerEnd(rayTraceTimer, count);
+    glDisable(GL_SCISSOR_TEST);
+    
+    tileNext += count;
+}
+
+// Function to fill the pixels that were not traced this frame into the bound
+// framebuffer from the interlaced samples
+void DrawReconstructPass(int width, int height, int phase, int phaseCount) {
+    glUseProgram(reconstructProgramID);
+    glUniform1i(reconstructPhaseCountLoc, phaseCount);
+    glUniform1i(reconstructCurrentPhaseLoc, phase);
+    glUniform1i(reconstructValidPhasesLoc, interlaceValidPhases);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, interlaceSamplesTexture);
+    
+    glViewport(0, 0, width, height);
+    glBindVertexArray(quadVAO);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    glBindVertexArray(0);
+}
+
+// Function to rebuild the adaptive sampling mask from the moments of the
+// running average. The number of active tiles is counted with an occlusion
+// query that is read back without waiting, see CollectSampleMaskQuery.
+void UpdateSampleMask(int width, int height, GLuint momentsTexture) {
+    int tilesX = (width + adaptiveTileSize - 1) / adaptiveTileSize;
+    int tilesY = (height + adaptiveTileSize - 1) / adaptiveTileSize;
+    adaptiveTileCount = tilesX * tilesY;
+    GpuRenderTarget("sampleMaskTarget", GL_R8, tilesX, tilesY, &sampleMaskTexture);
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+    
+    glUseProgram(sampleMaskProgramID);
+    glUniform1i(sampleMaskTileSizeLoc, adaptiveTileSize);
+    glUniform1f(sampleMaskThresholdLoc, adaptiveThreshold);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, momentsTexture);
+    
+    bool query = !adaptiveQueryPending;
+    if (query) {
+        if (adaptiveQuery == 0) glGenQueries(1, &adaptiveQuery);
+        glBeginQuery(GL_SAMPLES_PASSED, adaptiveQuery);
+    }
+    glViewport(0, 0, tilesX, tilesY);
+    glBindVertexArray(quadVAO);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    glBindVertexArray(0);
+    if (query) {
+        glEndQuery(GL_SAMPLES_PASSED);
+        adaptiveQueryPending = true;
+        adaptiveQueryGeneration = accumulationGeneration;
+        adaptiveQueryTiles = adaptiveTileCount;
+    }
+}
+
+// Function to pick up the active tile count once the GPU has it. Counts from
+// before the last accumulation restart are dropped.
+void CollectSampleMaskQuery() {
+    if (!adaptiveQueryPending) return;
+    GLint available = 0;
+    glGetQueryObjectiv(adaptiveQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) return;
+    
+    GLuint activeTiles = 0;
+    glGetQueryObjectuiv(adaptiveQuery, GL_QUERY_RESULT, &activeTiles);
+    adaptiveQueryPending = false;
+    if (adaptiveQueryGeneration == accumulationGeneration && adaptiveQueryTiles == adaptiveTileCount) {
+        adaptiveActiveTiles = (int)activeTiles;
+    }
+}
+
+// Function to bind textures to the units 0, 1, ... in order
+void BindTextures(const GLuint* textures, int count) {
+    for (int i = 0; i < count; i++) {
+        glActiveTexture(GL_TEXTURE0 + i);
+        glBindTexture(GL_TEXTURE_2D, textures[i]);
+    }
+    glActiveTexture(GL_TEXTURE0);
+}
+
+// Function to trace and denoise one frame of a width x height image into
+// denoiseOutputTexture, timing the trace, temporal and a-trous passes
+void DrawDenoisePasses(int width, int height) {
+    int next = 1 - denoiseCurrent;
+    const GLuint* frame = denoiseFrameTextures[next];
+    const GLuint* previousFrame = denoiseFrameTextures[denoiseCurrent];
+    
+    // One sample per pixel through the pixel centers, with fresh random numbers
+    bool timed = GpuTimerBegin(denoiseTimers[DENOISE_TRACE]);
+    glBindFramebuffer(GL_FRAMEBUFFER, GpuFramebuffer(next == 0 ? "denoiseFrameA" : "denoiseFrameB"));
+    RayTracePass pass;
+    pass.seed = denoiseFrame++;
+    DrawRayTracePass(width, height, pass);
+    if (timed) GpuTimerEnd(denoiseTimers[DENOISE_TRACE]);
+    
+    // Blend with the reprojected history
+    timed = GpuTimerBegin(denoiseTimers[DENOISE_TEMPORAL]);
+    glBindFramebuffer(GL_FRAMEBUFFER, GpuFramebuffer(next == 0 ? "denoiseHistoryA" : "denoiseHistoryB"));
+    glUseProgram(denoiseTemporalProgramID);
+    glUniformMatrix4fv(denoisePreviousViewProjectionLoc, 1, GL_FALSE, glm::value_ptr(denoiseViewProjection));
+    glUniform3fv(denoiseTemporalEyeLoc, 1, glm::value_ptr(cameraPosition));
+    glUniform1i(denoiseHistoryValidLoc, denoiseHistoryValid ? 1 : 0);
+    glUniform1f(denoiseColorAlphaLoc, denoiseColorAlpha);
+    glUniform1f(denoiseMomentsAlphaLoc, denoiseMomentsAlpha);
+    GLuint temporalInputs[8] = { frame[0], frame[1], frame[3], frame[4],
+                                 denoiseHistoryTextures[denoiseCurrent][0], denoiseHistoryTextures[denoiseCurrent][1],
+                                 previousFrame[1], previousFrame[3] };
+    BindTextures(temporalInputs, 8);
+    glBindVertexArray(quadVAO);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    if (timed) GpuTimerEnd(denoiseTimers[DENOISE_TEMPORAL]);
+    
+    // Edge-avoiding wavelet iterations with growing step size; the last one
+    // writes the remodulated color
+    timed = GpuTimerBegin(denoiseTimers[DENOISE_ATROUS]);
+    glUseProgram(denoiseAtrousProgramID);
+    glUniform3fv(denoiseAtrousEyeLoc, 1, glm::value_ptr(cameraPosition));
+    glUniform1f(denoisePixelFootprintLoc, 2.0f * tan(glm::radians(cameraFOV) * 0.5f) / height);
+    GLuint source = denoiseHistoryTextures[next][0];
+    for (int i = 0; i < denoiseIterations; i++) {
+        bool last = i == denoiseIterations - 1;
+        const char* target = last ? "denoiseOutput" : (i % 2 == 0 ? "denoiseFilterA" : "denoiseFilterB");
+        glBindFramebuffer(GL_FRAMEBUFFER, GpuFramebuffer(target));
+        glUniform1i(denoiseStepSizeLoc, 1 << i);
+        glUniform1i(denoiseModulateLoc, last ? 1 : 0);
+        GLuint atrousInputs[4] = { source, frame[1], frame[3], frame[4] };
+        BindTextures(atrousInputs, 4);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        source = denoiseFilterTextures[i % 2];
+    }
+    glBindVertexArray(0);
+    if (timed) GpuTimerEnd(denoiseTimers[DENOISE_ATROUS]);
+    
+    denoiseCurrent = next;
+    denoiseHistoryValid = true;
+    denoiseViewProjection = ComputeViewProjection(width, height);
+}
+
+// Produces this frame's ray-traced image according to frameMode. Nothing is
+// traced when the scene is unchanged and the image is final, which is
+// reported through rayTraceImageUpdated.
+void RenderRayTracing() {
+    // Feed finished GPU timings to the resolution controller. Only full frames
+    // are adapted, since a resolution change restarts progressive accumulation.
+    // Timings queued under the previous frame mode measured different work.
+    if (frameMode != lastFrameMode) {
+        GpuTimerDiscard(rayTraceTimer);
+    }
+    if (GpuTimerCollect(rayTraceTimer)) {
+        if (dynamicResolution && frameMode == FRAME_MODE_FULL) {
+            UpdateDynamicResolution(rayTraceTimer.lastMs);
+        }
+        if (frameMode == FRAME_MODE_TILED && rayTraceTimer.lastWork > 0.0) {
+            UpdateTileBudget(rayTraceTimer.lastMs / rayTraceTimer.lastWork);
+        }
+    }
+    for (int i = 0; i < DENOISE_PASS_COUNT; i++) {
+        GpuTimerCollect(denoiseTimers[i]);
+    }
+    
+    int windowWidth, windowHeight;
+    GetFramebufferSize(&windowWidth, &windowHeight);
+    float scale = dynamicResolution ? renderScale : 1.0f;
+    int width = glm::max(1, (int)(windowWidth * scale + 0.5f));
+    int height = glm::max(1, (int)(windowHeight * scale + 0.5f));
+    renderWidth = width;
+    renderHeight = height;
+    
+    int changes = UpdateRayTraceInputs(width, height);
+    bool modeChanged = frameMode != lastFrameMode;
+    bool changed = changes != 0 || modeChanged;
+    lastFrameMode = frameMode;
+    
+    if (frameMode == FRAME_MODE_PROGRESSIVE) {
+        // Color and luminance moments; primary hits (location 1) are not kept
+        const GLenum formats[3] = { GL_RGBA32F, GL_NONE, GL_RGBA32F };
+        GLuint targetA[3], targetB[3];
+        changed |= GpuRenderTargets("accumulationA", 3, formats, width, height, targetA);
+        changed |= GpuRenderTargets("accumulationB", 3, formats, width, height, targetB);
+        accumulationTextures[0] = targetA[0];
+        accumulationMoments[0] = targetA[2];
+        accumulationTextures[1] = targetB[0];
+        accumulationMoments[1] = targetB[2];
+        changed |= adaptiveSampling != lastAdaptiveSampling;
+        lastAdaptiveSampling = adaptiveSampling;
+        if (changed) {
+            accumulatedSamples = 0;
+            accumulationGeneration++;
+            adaptivePixelSamples = 0.0;
+        }
+        
+        // A new threshold needs a new mask before convergence can be judged
+        if (changed || adaptiveThreshold != lastAdaptiveThreshold) {
+            adaptiveActiveTiles = -1;
+        }
+        lastAdaptiveThreshold = adaptiveThreshold;
+        CollectSampleMaskQuery();
+        
+        // Add one sample per frame until the image has converged, either by
+        // sample count or because no tile is above the error threshold
+        bool adaptive = adaptiveSampling && accumulatedSamples >= adaptiveMinSamples;
+        bool trace = accumulatedSamples < maxAccumulatedSamples && !(adaptive && adaptiveActiveTiles == 0);
+        if (trace) {
+            int next = 1 - accumulationCurrent;
+            glBindFramebuffer(GL_FRAMEBUFFER, GpuFramebuffer(next == 0 ? "accumulationA" : "accumulationB"));
+            bool timed = GpuTimerBegin(rayTraceTimer);
+            RayTracePass pass;
+            pass.sample = accumulatedSamples;
+            pass.historyTexture = accumulationTextures[accumulationCurrent];
+            pass.historyMoments = accumulationMoments[accumulationCurrent];
+            pass.sampleMask = adaptive ? sampleMaskTexture : 0;
+            DrawRayTracePass(width, height, pass);
+            accumulationCurrent = next;
+            accumulatedSamples++;
+            
+            if (adaptiveSampling && accumulatedSamples >= adaptiveMinSamples) {
+                UpdateSampleMask(width, height, accumulationMoments[accumulationCurrent]);
+            }
+            if (timed) GpuTimerEnd(rayTraceTimer);
+            
+            // Estimated from the latest known tile count
+            double fraction = adaptive && adaptiveActiveTiles >= 0 && adaptiveTileCount > 0
+                                  ? (double)adaptiveActiveTiles / adaptiveTileCount : 1.0;
+            adaptivePixelSamples += fraction * width * height;
+        }
+        rayTraceImageUpdated = trace;
+        rayTraceOutputTexture = accumulationTextures[accumulationCurrent];
+    } else if (frameMode == FRAME_MODE_TEMPORAL) {
+        const GLenum formats[2] = { GL_RGBA16F, GL_RGBA32F };
+        bool reallocated = GpuRenderTargets("temporalA", 2, formats, width, height, temporalTextures[0]);
+        reallocated |= GpuRenderTargets("temporalB", 2, formats, width, height, temporalTextures[1]);
+        changed |= reallocated;
+        
+        // Only camera motion can be reprojected, anything else starts over
+        if (reallocated || modeChanged || (changes & RAY_TRACE_SCENE_CHANGED)) {
+            temporalHistoryValid = false;
+        }
+        
+        // Once the camera stops, keep re-tracing the rotating subset until every
+        // reprojected pixel has been replaced by a traced one
+        bool trace = changed || temporalRefreshFrames > 0;
+        if (trace) {
+            bool reproject = temporalHistoryValid;
+            int next = 1 - temporalCurrent;
+            glBindFramebuffer(GL_FRAMEBUFFER, GpuFramebuffer(next == 0 ? "temporalA" : "temporalB"));
+            bool timed = GpuTimerBegin(rayTraceTimer);
+            RayTracePass pass;
+            pass.reproject = reproject;
+            DrawRayTracePass(width, height, pass);
+            if (timed) GpuTimerEnd(rayTraceTimer);
+            
+            if (changed) {
+                temporalRefreshFrames = reproject ? temporalRefreshPeriod - 1 : 0;
+            } else {
+                temporalRefreshFrames--;
+            }
+            temporalCurrent = next;
+            temporalHistoryValid = true;
+            temporalViewProjection = ComputeViewProjection(width, height);
+            temporalFrame++;
+        }
+        rayTraceImageUpdated = trace;
+        rayTraceOutputTexture = temporalTextures[temporalCurrent][0];
+    } else if (frameMode == FRAME_MODE_TILED) {
+        changed |= GpuRenderTarget("tiledTarget", GL_RGBA16F, width, height, &tiledTargetTexture);
+        changed |= tileSize != lastTileSize;
+        lastTileSize = tileSize;
+        tileCount = ((width + tileSize - 1) / tileSize) * ((height + tileSize - 1) / tileSize);
+        
+        // A change restarts the image; the old one stays visible under the new tiles
+        if (changed) {
+            tileNext = 0;
+        }
+        bool trace = tileNext < tileCount;
+        if (trace) {
+            DrawRayTraceTiles(width, height);
+        }
+        rayTraceImageUpdated = trace;
+        rayTraceOutputTexture = tiledTargetTexture;
+    } else if (frameMode == FRAME_MODE_INTERLACED) {
+        int phaseCount = interlaceMode == 0 ? 2 : 4;
+        bool reallocated = GpuRenderTarget("interlaceSamples", GL_RGBA16F, width, height, &interlaceSamplesTexture);
+        if (reallocated) {
+            // Alpha 0 marks samples that were never traced
+            glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+            glClear(GL_COLOR_BUFFER_BIT);
+        }
+        changed |= reallocated || phaseCount != lastInterlacePhases;
+        lastInterlacePhases = phaseCount;
+        if (changed) {
+            interlaceValidPhases = 0;
+        }
+        
+        // Keep cycling through the phases until all of them show the current state
+        bool trace = interlaceValidPhases != (1 << phaseCount) - 1;
+        if (trace) {
+            // Quarter mode visits the 2x2 block diagonally to spread the samples
+            static const int quarterOrder[4] = { 0, 3, 1, 2 };
+            int phase = phaseCount == 4 ? quarterOrder[interlaceStep % 4] : interlaceStep % 2;
+            interlaceStep++;
+            
+            bool timed = GpuTimerBegin(rayTraceTimer);
+            RayTracePass pass;
+            pass.interlacePhase = phase;
+            pass.interlacePhaseCount = phaseCount;
+            DrawRayTracePass(width, height, pass);
+            GpuRenderTarget("interlaceOutput", GL_RGBA16F, width, height, &interlaceOutputTexture);
+            DrawReconstructPass(width, height, phase, phaseCount);
+            if (timed) GpuTimerEnd(rayTraceTimer);
+            interlaceValidPhases |= 1 << phase;
+        }
+        rayTraceImageUpdated = trace;
+        rayTraceOutputTexture = interlaceOutputTexture;
+    } else if (frameMode == FRAME_MODE_DENOISED) {
+        // Frames keep the guide buffers of their primary hits; moments are
+        // tracked by the temporal pass instead
+        const GLenum frameFormats[5] = { GL_RGBA16F, GL_RGBA32F, GL_NONE, GL_RGBA16F, GL_RGBA8 };
+        const GLenum historyFormats[2] = { GL_RGBA16F, GL_RGBA16F };
+        bool reallocated = GpuRenderTargets("denoiseFrameA", 5, frameFormats, width, height, denoiseFrameTextures[0]);
+        reallocated |= GpuRenderTargets("denoiseFrameB", 5, frameFormats, width, height, denoiseFrameTextures[1]);
+        reallocated |= GpuRenderTargets("denoiseHistoryA", 2, historyFormats, width, height, denoiseHistoryTextures[0]);
+        reallocated |= GpuRenderTargets("denoiseHistoryB", 2, historyFormats, width, height, denoiseHistoryTextures[1]);
+        reallocated |= GpuRenderTarget("denoiseFilterA", GL_RGBA16F, width, height, &denoiseFilterTextures[0]);
+        reallocated |= GpuRenderTarget("denoiseFilterB", GL_RGBA16F, width, height, &denoiseFilterTextures[1]);
+        reallocated |= GpuRenderTarget("denoiseOutput", GL_RGBA16F, width, height, &denoiseOutputTexture);
+        changed |= reallocated;
+        
+        // Reprojection rejects what moved and the history follows other
+        // changes within a few frames, so only new targets drop it
+        if (reallocated || modeChanged) {
+            denoiseHistoryValid = false;
+        }
+        if (changed) {
+            denoiseStillFrames = 0;
+        }
+        bool trace = denoiseStillFrames < denoiseSettleFrames;
+        if (trace) {
+            DrawDenoisePasses(width, height);
+            denoiseStillFrames++;
+        }
+        rayTraceImageUpdated = trace;
+        rayTraceOutputTexture = denoiseOutputTexture;
+    } else {
+        bool wavefront = useWavefront && wavefrontSupported;
+        changed |= wavefront != lastUseWavefront;
+        lastUseWavefront = wavefront;
+        changed |= GpuRenderTarget("rayTraceTarget", GL_RGBA16F, width, height, &rayTraceTargetTexture);
+        if (changed) {
+            bool timed = GpuTimerBegin(rayTraceTimer);
+            if (wavefront) {
+                DrawWavefrontPass(width, height);
+            } else {
+                DrawRayTracePass(width, height);
+            }
+            if (timed) GpuTimerEnd(rayTraceTimer);
+        }
+        rayTraceImageUpdated = changed;
+        rayTraceOutputTexture = rayTraceTargetTexture;
+    }
+    
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// Function to time the fragment and the wavefront path on the current scene.
+// Each path traces benchmarkFrames full frames; glFinish brackets the loop so
+// the wall time covers the GPU work. Light culling, shadow maps and hybrid
+// primary hits only exist in the fragment path, so they are turned off for
+// both paths to compare the same work.
+void RunRayTraceBenchmark() {
+    int savedMode = frameMode;
+    bool savedWavefront = useWavefront;
+    bool savedDynamicResolution = dynamicResolution;
+    bool savedLightCulling = lightCulling;
+    bool savedShadowMaps = useShadowMaps;
+    bool savedHybridPrimary = useHybridPrimary;
+    frameMode = FRAME_MODE_FULL;
+    dynamicResolution = false;
+    lightCulling = false;
+    useShadowMaps = false;
+    useHybridPrimary = false;
+    
+    for (int path = 0; path < 2; path++) {
+        useWavefront = path == 1;
+        if (useWavefront && !wavefrontSupported) {
+            benchmarkMs[path] = 0.0;
+            break;
+        }
+        
+        // The first frame may compile programs and allocate buffers
+        RenderRayTracing();
+        glFinish();
+        double start = glfwGetTime();
+        for (int i = 0; i < benchmarkFrames; i++) {
+            sceneDirty = true;
+            RenderRayTracing();
+        }
+        glFinish();
+        benchmarkMs[path] = (glfwGetTime() - start) * 1000.0 / benchmarkFrames;
+        printf("Benchmark %s path: %.2f ms per frame (%d x %d, %d frames)\n",
+               useWavefront ? "wavefront" : "fragment", benchmarkMs[path], renderWidth, renderHeight, benchmarkFrames);
+    }
+    
+    frameMode = savedMode;
+    useWavefront = savedWavefront;
+    dynamicResolution = savedDynamicResolution;
+    lightCulling = savedLightCulling;
+    useShadowMaps = savedShadowMaps;
+    useHybridPrimary = savedHybridPrimary;
+    sceneDirty = true;
+}
+
+// Draws the cached ray-traced image to the window
+void PresentRayTracing() {
+    int width, height;
+    GetFramebufferSize(&width, &height);
+    glViewport(0, 0, width, height);
+    
+    glUseProgram(presentProgramID);
+    glUniform2f(presentSourceSizeLoc, (float)renderWidth, (float)renderHeight);
+    glUniform1f(presentSharpnessLoc, upscaleSharpness);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, rayTraceOutputTexture);
+    glBindVertexArray(quadVAO);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    glBindVertexArray(0);
+}
+
 static void onDisplay()
 {
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     if (useRayTracing) {
+        if (benchmarkRequested) {
+            RunRayTraceBenchmark();
+            benchmarkRequested = false;
+        }
+        GpuProfilerBeginSection(gpuProfiler, PROFILE_RAY_TRACING);
         RenderRayTracing();
+        GpuProfilerEndSection(gpuProfiler, PROFILE_RAY_TRACING);
+        GpuProfilerBeginSection(gpuProfiler, PROFILE_RASTER);
+        PresentRayTracing();
+        GpuProfilerEndSection(gpuProfiler, PROFILE_RASTER);
     } else {
+        GpuProfilerBeginSection(gpuProfiler, PROFILE_RASTER);
+        
         // Create rotation matrix using GLM
         glm::mat4 rotationMatrix = glm::rotate(
             glm::mat4(1.0f),  // Identity matrix
@@ -745,7 +2594,7 @@ static void onDisplay()
         
         // Get current window size to ensure correct aspect ratio
         int width, height;
-        glfwGetFramebufferSize(glfwGetCurrentContext(), &width, &height);
+        GetFramebufferSize(&width, &height);
         float aspectRatio = (float)width / (float)height;
         
         // Projection matrix - 45° FOV with proper aspect ratio
@@ -757,7 +2606,7 @@ static void onDisplay()
         );
         
         // Pass all matrices to the shader
-        glUseProgram(gWorldLocation);
+        glUseProgram(rasterProgramID);
         glUniformMatrix4fv(gWorldLocation, 1, GL_FALSE, glm::value_ptr(worldMatrix));
         glUniformMatrix4fv(gViewLocation, 1, GL_FALSE, glm::value_ptr(viewMatrix));
         glUniformMatrix4fv(gProjectionLocation, 1, GL_FALSE, glm::value_ptr(projectionMatrix));
@@ -765,6 +2614,7 @@ static void onDisplay()
         glBindVertexArray(VAO);
         glDrawElements(GL_TRIANGLES, numIndices, GL_UNSIGNED_INT, 0);
         glBindVertexArray(0);
+        GpuProfilerEndSection(gpuProfiler, PROFILE_RASTER);
     }
 
 	/* check for any errors when rendering */
@@ -846,9 +2696,109 @@ void RenderImGui()
         // Ray tracing settings
         if (ImGui::CollapsingHeader("Ray Tracing Settings", ImGuiTreeNodeFlags_DefaultOpen)) {
             ImGui::Checkbox("Enable Shadows", &enableShadows);
+            ImGui::Checkbox("Rasterized Primary Hits (Hybrid)", &useHybridPrimary);
+            if (useHybridPrimary && numTracedIndices < numIndices) {
+                ImGui::TextDisabled("Rasterizing the %d traced of %d mesh triangles",
+                                    numTracedIndices / 3, numIndices / 3);
+            }
+            ImGui::Checkbox("Shadow Maps for Primary Hits", &useShadowMaps);
+            if (useShadowMaps) {
+                ImGui::Combo("Shadow Map Size", &shadowMapSizeIndex, shadowMapSizeNames, 4);
+                ImGui::Text("%d of %d lights mapped, rendered %d times",
+                            glm::min((int)lights.size(), MAX_SHADOW_MAP_LIGHTS), (int)lights.size(), shadowMapRenders);
+            }
             ImGui::Checkbox("Enable Reflections", &enableReflections);
             ImGui::SliderInt("Max Reflection Bounces", &maxBounces, 0, 10);
             ImGui::SliderFloat("Global Reflectivity", &reflectivity, 0.0f, 1.0f);
+            ImGui::SliderFloat("Glossy Roughness", &glossyRoughness, 0.0f, 0.5f);
+            ImGui::Checkbox("Specialized Shaders", &useSpecializedShaders);
+            ImGui::SameLine();
+            ImGui::TextDisabled("(%d cached)", (int)rayTraceProgramCache.size());
+            ImGui::Text("Shader binary cache: %d hits, %d misses", shaderCacheHits, shaderCacheMisses);
+            ImGui::Combo("Frame Mode", &frameMode, frameModeNames, FRAME_MODE_COUNT);
+            if (frameMode == FRAME_MODE_PROGRESSIVE) {
+                ImGui::SliderInt("Max Samples", &maxAccumulatedSamples, 1, 4096);
+                ImGui::ProgressBar((float)accumulatedSamples / (float)maxAccumulatedSamples, ImVec2(-1.0f, 0.0f));
+                ImGui::Text("Samples: %d", accumulatedSamples);
+                ImGui::Checkbox("Adaptive Sampling", &adaptiveSampling);
+                if (adaptiveSampling) {
+                    ImGui::SliderFloat("Error Threshold", &adaptiveThreshold, 0.001f, 0.2f, "%.3f", ImGuiSliderFlags_Logarithmic);
+                    ImGui::SliderInt("Min Samples", &adaptiveMinSamples, 2, 64);
+                    if (adaptiveActiveTiles >= 0 && adaptiveTileCount > 0) {
+                        ImGui::Text("Converged: %.1f%% of tiles",
+                                    100.0f * (1.0f - (float)adaptiveActiveTiles / (float)adaptiveTileCount));
+                    }
+                    ImGui::Text("Samples per pixel: %.1f (uniform: %d)",
+                                adaptivePixelSamples / ((double)renderWidth * renderHeight), accumulatedSamples);
+                }
+            }
+            if (frameMode == FRAME_MODE_TEMPORAL) {
+                ImGui::SliderInt("Refresh Period", &temporalRefreshPeriod, 2, 32);
+                ImGui::Text("Re-traced per frame: disoccluded + 1/%d of pixels", temporalRefreshPeriod);
+                ImGui::Text("Refresh frames left: %d", temporalRefreshFrames);
+            }
+            if (frameMode == FRAME_MODE_TILED) {
+                ImGui::SliderInt("Tile Size", &tileSize, 16, 256);
+                ImGui::SliderFloat("Tile Budget (ms)", &tileBudgetMs, 1.0f, 50.0f);
+                ImGui::ProgressBar(tileCount > 0 ? (float)tileNext / (float)tileCount : 0.0f, ImVec2(-1.0f, 0.0f));
+                ImGui::Text("Tiles: %d / %d, %d per frame (%.2f ms each)", tileNext, tileCount, tilesPerFrame, tileCostMs);
+            }
+            if (frameMode == FRAME_MODE_DENOISED) {
+                ImGui::SliderInt("A-trous Iterations", &denoiseIterations, 1, 5);
+                ImGui::SliderFloat("History Blend", &denoiseColorAlpha, 0.05f, 1.0f);
+                for (int i = 0; i < DENOISE_PASS_COUNT; i++) {
+                    ImGui::Text("%s: %.2f ms", denoisePassNames[i], denoiseTimers[i].lastMs);
+                }
+            }
+            if (frameMode == FRAME_MODE_INTERLACED) {
+                ImGui::Combo("Pixels per Frame", &interlaceMode, interlaceModeNames, 2);
+                int phaseCount = interlaceMode == 0 ? 2 : 4;
+                int validCount = 0;
+                for (int p = 0; p < phaseCount; p++) {
+                    if (interlaceValidPhases & (1 << p)) validCount++;
+                }
+                ImGui::Text("Up-to-date phases: %d / %d", validCount, phaseCount);
+            }
+            ImGui::Text("Image: %s", rayTraceImageUpdated ? "traced" : "cached (idle)");
+            if (wavefrontSupported) {
+                ImGui::Checkbox("Wavefront (compute)", &useWavefront);
+                if (useWavefront && frameMode != FRAME_MODE_FULL) {
+                    ImGui::TextDisabled("Wavefront is used in Full frame mode only");
+                }
+                if (useWavefront && (lightCulling || useShadowMaps || useHybridPrimary)) {
+                    ImGui::TextDisabled("Wavefront ignores light culling, shadow maps and hybrid mode");
+                }
+            } else {
+                ImGui::TextDisabled("Wavefront path needs OpenGL 4.3");
+            }
+            ImGui::SliderInt("Benchmark Frames", &benchmarkFrames, 1, 200);
+            if (ImGui::Button("Benchmark Fragment vs Wavefront")) {
+                benchmarkRequested = true;
+            }
+            ImGui::TextDisabled("Both paths run without light culling, shadow maps and hybrid mode");
+            if (benchmarkMs[0] > 0.0) {
+                ImGui::Text("Fragment: %.2f ms  Wavefront: %.2f ms", benchmarkMs[0], benchmarkMs[1]);
+            }
+        }
+        
+        // Dynamic resolution
+        if (ImGui::CollapsingHeader("Dynamic Resolution")) {
+            if (ImGui::Checkbox("Enable##dynres", &dynamicResolution) && dynamicResolution) {
+                ResetDynamicResolution(maxRenderScale);
+            }
+            ImGui::SliderFloat("Target GPU Time (ms)", &targetFrameMs, 2.0f, 100.0f);
+            bool boundsChanged = ImGui::SliderFloat("Min Scale", &minRenderScale, 0.1f, 1.0f);
+            boundsChanged |= ImGui::SliderFloat("Max Scale", &maxRenderScale, 0.1f, 1.0f);
+            if (minRenderScale > maxRenderScale) minRenderScale = maxRenderScale;
+            if (boundsChanged) {
+                ResetDynamicResolution(renderScale);
+            }
+            ImGui::SliderFloat("Upscale Edge Sharpness", &upscaleSharpness, 0.0f, 16.0f);
+            ImGui::Text("Ray trace GPU time: %.2f ms", rayTraceTimer.lastMs);
+            ImGui::Text("Render scale: %.2f (%d x %d)", dynamicResolution ? renderScale : 1.0f, renderWidth, renderHeight);
+            if (frameMode != FRAME_MODE_FULL) {
+                ImGui::TextDisabled("Scale is held while not in Full frame mode");
+            }
         }
         
         // Camera settings
@@ -862,53 +2812,110 @@ void RenderImGui()
         
         // Scene objects
         if (ImGui::CollapsingHeader("Scene Objects", ImGuiTreeNodeFlags_DefaultOpen)) {
-            ImGui::Text("Objects: %d", numObjects);
+            ImGui::Text("Spheres: %d, Boxes: %d, Mesh instances: %d",
+                        (int)spheres.size(), (int)boxes.size(), (int)meshInstances.size());
             
-            for (int i = 0; i < numObjects; i++) {
+            for (size_t i = 0; i < spheres.size(); i++) {
                 char label[32];
-                snprintf(label, sizeof(label), "Object %d", i);
+                snprintf(label, sizeof(label), "Sphere %d", (int)i);
                 
                 if (ImGui::TreeNode(label)) {
-                    const char* typeNames[] = { "Sphere", "Cube", "Mesh" };
-                    ImGui::Text("Type: %s", typeNames[sceneObjects[i].type]);
+                    ImGui::Text("Position");
+                    ImGui::SliderFloat("X##pos", &spheres[i].center.x, -5.0f, 5.0f);
+                    ImGui::SliderFloat("Y##pos", &spheres[i].center.y, -5.0f, 5.0f);
+                    ImGui::SliderFloat("Z##pos", &spheres[i].center.z, -5.0f, 5.0f);
+                    ImGui::SliderFloat("Radius", &spheres[i].radius, 0.1f, 3.0f);
                     
+                    ImGui::Text("Color");
+                    ImGui::ColorEdit3("##color", glm::value_ptr(spheres[i].color));
+                    ImGui::SliderFloat("Reflectivity", &spheres[i].reflectivity, 0.0f, 1.0f);
+                    
+                    ImGui::TreePop();
+                }
+            }
+            
+            for (size_t i = 0; i < boxes.size(); i++) {
+                char label[32];
+                snprintf(label, sizeof(label), "Box %d", (int)i);
+                
+                if (ImGui::TreeNode(label)) {
                     ImGui::Text("Position");
-                    ImGui::SliderFloat("X##pos", &sceneObjects[i].position.x, -5.0f, 5.0f);
-                    ImGui::SliderFloat("Y##pos", &sceneObjects[i].position.y, -5.0f, 5.0f);
-                    ImGui::SliderFloat("Z##pos", &sceneObjects[i].position.z, -5.0f, 5.0f);
+                    ImGui::SliderFloat("X##pos", &boxes[i].center.x, -5.0f, 5.0f);
+                    ImGui::SliderFloat("Y##pos", &boxes[i].center.y, -5.0f, 5.0f);
+                    ImGui::SliderFloat("Z##pos", &boxes[i].center.z, -5.0f, 5.0f);
                     
-                    if (sceneObjects[i].type == 0) { // Sphere
-                        ImGui::SliderFloat("Radius", &sceneObjects[i].size.x, 0.1f, 3.0f);
-                    } else if (sceneObjects[i].type == 1) { // Cube
-                        ImGui::Text("Size");
-                        ImGui::SliderFloat("X##size", &sceneObjects[i].size.x, 0.1f, 5.0f);
-                        ImGui::SliderFloat("Y##size", &sceneObjects[i].size.y, 0.1f, 5.0f);
-                        ImGui::SliderFloat("Z##size", &sceneObjects[i].size.z, 0.1f, 5.0f);
-                    }
+                    ImGui::Text("Size");
+                    ImGui::SliderFloat("X##size", &boxes[i].halfSize.x, 0.1f, 5.0f);
+                    ImGui::SliderFloat("Y##size", &boxes[i].halfSize.y, 0.1f, 5.0f);
+                    ImGui::SliderFloat("Z##size", &boxes[i].halfSize.z, 0.1f, 5.0f);
+                    
+                    ImGui::Text("Color");
+                    ImGui::ColorEdit3("##color", glm::value_ptr(boxes[i].color));
+                    ImGui::SliderFloat("Reflectivity", &boxes[i].reflectivity, 0.0f, 1.0f);
+                    
+                    ImGui::TreePop();
+                }
+            }
+            
+            for (size_t i = 0; i < meshInstances.size(); i++) {
+                char label[32];
+                snprintf(label, sizeof(label), "Mesh %d", (int)i);
+                
+                if (ImGui::TreeNode(label)) {
+                    ImGui::Text("Position");
+                    ImGui::SliderFloat("X##pos", &meshInstances[i].position.x, -5.0f, 5.0f);
+                    ImGui::SliderFloat("Y##pos", &meshInstances[i].position.y, -5.0f, 5.0f);
+                    ImGui::SliderFloat("Z##pos", &meshInstances[i].position.z, -5.0f, 5.0f);
                     
                     ImGui::Text("Color");
-                    ImGui::ColorEdit3("##color", glm::value_ptr(sceneObjects[i].color));
-                    ImGui::SliderFloat("Reflectivity", &sceneObjects[i].reflectivity, 0.0f, 1.0f);
+                    ImGui::ColorEdit3("##color", glm::value_ptr(meshInstances[i].color));
+                    ImGui::SliderFloat("Reflectivity", &meshInstances[i].reflectivity, 0.0f, 1.0f);
                     
                     ImGui::TreePop();
                 }
             }
             
+            // New primitives appear above the scene so they are easy to find
+            if (ImGui::Button("Add Sphere")) {
+                AddSphere(glm::vec3(0.0f, 1.5f, 0.0f), 0.3f, glm::vec3(0.8f), 0.5f);
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("Add Box")) {
+                AddCube(glm::vec3(0.0f, 1.5f, 0.0f), glm::vec3(0.3f), glm::vec3(0.8f), 0.5f);
+            }
+            if (model) {
+                ImGui::SameLine();
+                if (ImGui::Button("Add Mesh Instance")) {
+                    AddMesh(glm::vec3(0.0f, 1.5f, 0.0f), glm::vec3(0.8f), 0.5f);
+                }
+            }
+            
             if (ImGui::Button("Reset Scene")) {
-                SetupScene();
+                SetupNamedScene();
             }
         }
         
         // Lights
         if (ImGui::CollapsingHeader("Lights", ImGuiTreeNodeFlags_DefaultOpen)) {
-            ImGui::Text("Lights: %d", numLights);
+            ImGui::Text("Lights: %d (tree: %d nodes)", (int)lights.size(), lightTreeNodeCount);
+            ImGui::SliderInt("Shadow Rays per Hit", &lightSamplesPerHit, 1, 16);
+            if ((int)lights.size() > lightSamplesPerHit) {
+                ImGui::TextDisabled("Lights are importance sampled from the light tree");
+            }
+            if (ImGui::Button("Add 10x10 Light Grid")) {
+                AddLightGrid(10, 10, 2.5f, 4.0f, 4.0f);
+            }
+            ImGui::Checkbox("Light Culling", &lightCulling);
+            if (lightCulling) {
+                ImGui::Text("Lights per cluster: %.1f avg, %d max", lightClusterAverage, lightClusterMax);
+            }
             
             // Ambient light
             ImGui::Text("Ambient Light");
             ImGui::ColorEdit3("##ambient", glm::value_ptr(ambientLight));
             
             // Point lights
-            for (int i = 0; i < numLights; i++) {
+            for (int i = 0; i < (int)lights.size(); i++) {
                 char label[32];
                 snprintf(label, sizeof(label), "Light %d", i);
                 
@@ -922,6 +2929,8 @@ void RenderImGui()
                     ImGui::ColorEdit3("##lightcolor", glm::value_ptr(lights[i].color));
                     
                     ImGui::SliderFloat("Intensity", &lights[i].intensity, 0.0f, 5.0f);
+                    ImGui::SliderFloat("Radius##light", &lights[i].radius, 0.0f, 2.0f);
+                    ImGui::SliderFloat("Range (0 = unbounded)", &lights[i].range, 0.0f, 30.0f);
                     
                     ImGui::TreePop();
                 }
@@ -960,27 +2969,515 @@ void RenderImGui()
         }
     }
 	
+    // GPU time of each pass over the last GPU_PROFILER_HISTORY frames. The
+    // results lag GPU_PROFILER_FRAMES frames behind.
+    if (ImGui::CollapsingHeader("GPU Profiler")) {
+        for (int i = 0; i < PROFILE_SECTION_COUNT; i++) {
+            const GpuProfilerSection& section = gpuProfiler.sections[i];
+            GpuProfilerStats stats;
+            if (!GpuProfilerSectionStats(section, stats)) {
+                ImGui::Text("%s: no samples", profileSectionNames[i]);
+                continue;
+            }
+            ImGui::Text("%s: %.2f ms (min %.2f, avg %.2f, p99 %.2f)", profileSectionNames[i],
+                        stats.lastMs, stats.minMs, stats.avgMs, stats.p99Ms);
+            
+            // The oldest sample sits at next once the history is full
+            char label[32];
+            snprintf(label, sizeof(label), "##profile%d", i);
+            int offset = section.count == GPU_PROFILER_HISTORY ? section.next : 0;
+            ImGui::PlotLines(label, section.history, section.count, offset, NULL,
+                             0.0f, stats.p99Ms * 1.25f + 0.01f, ImVec2(-1.0f, 40.0f));
+        }
+    }
+	
+    // Session-long frame time percentiles, see frame_stats.h
+    if (ImGui::CollapsingHeader("Frame Statistics")) {
+        const FrameHistogram* histograms[2] = { &frameStats.cpu, &frameStats.gpu };
+        const char* names[2] = { "CPU", "GPU" };
+        for (int i = 0; i < 2; i++) {
+            ImGui::Text("%s: p50 %.2f  p95 %.2f  p99 %.2f  max %.2f ms (%u frames)", names[i],
+                        FrameHistogramPercentile(*histograms[i], 0.50), FrameHistogramPercentile(*histograms[i], 0.95),
+                        FrameHistogramPercentile(*histograms[i], 0.99), histograms[i]->maxMs, histograms[i]->count);
+        }
+        ImGui::Text("Hitches: %u", frameStats.hitchCount);
+        float hitchFactor = (float)frameStats.hitchFactor;
+        if (ImGui::SliderFloat("Hitch Factor", &hitchFactor, 1.5f, 5.0f)) {
+            frameStats.hitchFactor = hitchFactor;
+        }
+        if (ImGui::Button("Reset Statistics")) {
+            frameStats = FrameStats();
+        }
+    }
+	
+    // GPU memory usage against the configured budget
+    if (ImGui::CollapsingHeader("GPU Memory")) {
+        static int budgetMB = (int)(gpuResources.budgetBytes / (1024 * 1024));
+        if (ImGui::SliderInt("Budget (MB)", &budgetMB, 16, 4096)) {
+            GpuSetMemoryBudget((size_t)budgetMB * 1024 * 1024);
+        }
+        for (int i = 0; i < GPU_RESOURCE_CATEGORY_COUNT; i++) {
+            ImGui::Text("%s: %d (%.2f MB)", gpuResourceCategoryNames[i],
+                        gpuResources.categoryCount[i], gpuResources.categoryBytes[i] / (1024.0 * 1024.0));
+        }
+        float used = (float)GpuTotalBytes() / (float)gpuResources.budgetBytes;
+        ImGui::ProgressBar(used < 1.0f ? used : 1.0f, ImVec2(-1.0f, 0.0f));
+        if (gpuResources.overBudget) {
+            ImGui::TextColored(ImVec4(1.0f, 0.3f, 0.3f, 1.0f), "Over budget");
+        }
+    }
+	
 	ImGui::End();
 
 	ImGui::Render();
 	ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 }
 
+/* post: release every GPU resource and the model */
+static void onShutdown()
+{
+	GpuRelease("meshVAO");
+	GpuRelease("meshVertices");
+	GpuRelease("meshIndices");
+	GpuRelease("meshData");
+	GpuRelease("quadVAO");
+	GpuRelease("quadVertices");
+	GpuRelease("raster");
+	GpuRelease("present");
+	GpuRelease("reconstruct");
+	GpuRelease("sampleMask");
+	GpuRelease("lightData");
+	GpuRelease("lightData:texture");
+	GpuRelease("lightTree");
+	GpuRelease("lightTree:texture");
+	GpuRelease("lightClusters");
+	GpuRelease("lightClusters:texture");
+	GpuRelease("shadowMap");
+	GpuRelease("shadowMaps");
+	GpuRelease("shadowMapDepth");
+	GpuRelease("shadowMapFramebuffer");
+	GpuRelease("shadowCubeVAO");
+	GpuRelease("shadowCubeVertices");
+	GpuRelease("shadowCubeIndices");
+	GpuRelease("shadowSphereVAO");
+	GpuRelease("shadowSphereVertices");
+	GpuRelease("shadowSphereIndices");
+	GpuRelease("gbufferPass");
+	GpuRelease("denoiseTemporal");
+	GpuRelease("denoiseAtrous");
+	GpuReleaseRenderTarget("denoiseFrameA");
+	GpuReleaseRenderTarget("denoiseFrameB");
+	GpuReleaseRenderTarget("denoiseHistoryA");
+	GpuReleaseRenderTarget("denoiseHistoryB");
+	GpuReleaseRenderTarget("denoiseFilterA");
+	GpuReleaseRenderTarget("denoiseFilterB");
+	GpuReleaseRenderTarget("denoiseOutput");
+	GpuRelease("gbufferDepth");
+	GpuReleaseRenderTarget("gbuffer");
+	if (adaptiveQuery != 0) glDeleteQueries(1, &adaptiveQuery);
+	GpuReleaseRenderTarget("rayTraceTarget");
+	GpuTimerRelease(rayTraceTimer);
+	GpuProfilerRelease(gpuProfiler);
+	for (int i = 0; i < DENOISE_PASS_COUNT; i++) {
+		GpuTimerRelease(denoiseTimers[i]);
+	}
+	GpuReleaseRenderTarget("accumulationA");
+	GpuReleaseRenderTarget("accumulationB");
+	GpuReleaseRenderTarget("temporalA");
+	GpuReleaseRenderTarget("temporalB");
+	GpuReleaseRenderTarget("tiledTarget");
+	GpuReleaseRenderTarget("interlaceSamples");
+	GpuReleaseRenderTarget("interlaceOutput");
+	GpuReleaseRenderTarget("sampleMaskTarget");
+	ReleaseRayTracePrograms();
+	if (wavefrontSupported) {
+		for (int i = 0; i < WAVEFRONT_STAGE_COUNT; i++) {
+			GpuRelease((std::string("wavefront:") + wavefrontStageNames[i]).c_str());
+		}
+		GpuRelease("wavefrontCounters");
+		GpuRelease("wavefrontPaths");
+		GpuRelease("wavefrontHits");
+		GpuRelease("wavefrontQueues");
+		GpuRelease("wavefrontShadowRays");
+	}
+	GpuRelease("cameraBlock");
+	GpuRelease("settingsBlock");
+	GpuRelease("sceneBlock");
+	GpuRelease("lightBlock");
+	if (GpuShutdown() > 0) {
+		fprintf(stderr, "GPU resources were still alive at shutdown\n");
+	}
+
+	// Free the model
+	if (model) {
+		FreeOffModel(model);
+	}
+}
+
+/* post: print the command-line options */
+static void PrintUsage(const char *program)
+{
+	printf("Usage: %s [options]\n"
+		   "  --model <file.off>     model to load (default %s)\n"
+		   "  --scene <name>         default, or light-grid to add a 10x10 grid of lights\n"
+		   "  --camera <x,y,z>       camera position\n"
+		   "  --target <x,y,z>       point the camera looks at\n"
+		   "  --fov <degrees>        vertical field of view\n"
+		   "  --size <w>x<h>         window or image size\n"
+		   "  --bounces <n>          reflection bounces, 0 disables reflections\n"
+		   "  --samples <n>          samples per pixel in headless mode\n"
+		   "  --shadows <hard|soft>  shadow model, headless mode defaults to hard for any sample count\n"
+		   "  --headless             render one image offscreen and exit\n"
+		   "  --output <file.ppm>    headless image (default %s)\n"
+		   "  --timing <file.json>   headless frame times (default %s)\n"
+		   "  --frame-stats <prefix> frame statistics files written on exit (default %s)\n",
+		   program, offFilePath, headlessImagePath, headlessTimingPath, frameStatsPath);
+}
+
+/* post: apply the command-line options, exits with the usage on errors */
+static void ParseCommandLine(int argc, char *argv[])
+{
+	for (int i = 1; i < argc; i++)
+	{
+		const char *option = argv[i];
+		if (!strcmp(option, "--help"))
+		{
+			PrintUsage(argv[0]);
+			exit(0);
+		}
+		if (!strcmp(option, "--headless"))
+		{
+			headless = true;
+			continue;
+		}
+		if (i + 1 >= argc)
+		{
+			fprintf(stderr, "Missing value for %s\n", option);
+			PrintUsage(argv[0]);
+			exit(1);
+		}
+
+		const char *value = argv[++i];
+		bool valid = true;
+		if (!strcmp(option, "--model"))
+			offFilePath = argv[i];
+		else if (!strcmp(option, "--scene"))
+		{
+			sceneName = value;
+			valid = !strcmp(value, "default") || !strcmp(value, "light-grid");
+		}
+		else if (!strcmp(option, "--camera"))
+			valid = sscanf(value, "%f,%f,%f", &cameraPosition.x, &cameraPosition.y, &cameraPosition.z) == 3;
+		else if (!strcmp(option, "--target"))
+			valid = sscanf(value, "%f,%f,%f", &cameraTarget.x, &cameraTarget.y, &cameraTarget.z) == 3;
+		else if (!strcmp(option, "--fov"))
+			valid = sscanf(value, "%f", &cameraFOV) == 1 && cameraFOV > 0.0f && cameraFOV < 180.0f;
+		else if (!strcmp(option, "--size"))
+			valid = sscanf(value, "%dx%d", &theWindowWidth, &theWindowHeight) == 2 && theWindowWidth > 0 && theWindowHeight > 0;
+		else if (!strcmp(option, "--bounces"))
+		{
+			valid = sscanf(value, "%d", &maxBounces) == 1 && maxBounces >= 0;
+			enableReflections = maxBounces > 0;
+		}
+		else if (!strcmp(option, "--samples"))
+			valid = sscanf(value, "%d", &headlessSamples) == 1 && headlessSamples > 0;
+		else if (!strcmp(option, "--shadows"))
+		{
+			softShadowMode = !strcmp(value, "soft") ? 1 : 0;
+			valid = !strcmp(value, "hard") || !strcmp(value, "soft");
+		}
+		else if (!strcmp(option, "--output"))
+			headlessImagePath = value;
+		else if (!strcmp(option, "--timing"))
+			headlessTimingPath = value;
+		else if (!strcmp(option, "--frame-stats"))
+			frameStatsPath = value;
+		else
+		{
+			fprintf(stderr, "Unknown option %s\n", option);
+			PrintUsage(argv[0]);
+			exit(1);
+		}
+
+		if (!valid)
+		{
+			fprintf(stderr, "Invalid value for %s: %s\n", option, value);
+			exit(1);
+		}
+	}
+}
+
+/* post: text quoted as a JSON string, with quotes, backslashes and control
+   characters escaped */
+static std::string JsonString(const char *text)
+{
+	std::string quoted = "\"";
+	for (const char *c = text; *c; c++)
+	{
+		if (*c == '"' || *c == '\\')
+		{
+			quoted += '\\';
+			quoted += *c;
+		}
+		else if ((unsigned char)*c < 0x20)
+		{
+			char escape[8];
+			snprintf(escape, sizeof(escape), "\\u%04x", (unsigned char)*c);
+			quoted += escape;
+		}
+		else
+			quoted += *c;
+	}
+	return quoted + "\"";
+}
+
+/* post: write width x height RGBA pixels, bottom row first as read from
+   OpenGL, to a binary PPM file */
+static bool WritePPM(const char *path, const std::vector<unsigned char> &pixels, int width, int height)
+{
+	FILE *file = fopen(path, "wb");
+	if (!file)
+	{
+		fprintf(stderr, "Failed to write image to %s\n", path);
+		return false;
+	}
+	fprintf(file, "P6\n%d %d\n255\n", width, height);
+	std::vector<unsigned char> row(width * 3);
+	for (int y = height - 1; y >= 0; y--)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			row[x * 3] = pixels[(y * width + x) * 4];
+			row[x * 3 + 1] = pixels[(y * width + x) * 4 + 1];
+			row[x * 3 + 2] = pixels[(y * width + x) * 4 + 2];
+		}
+		fwrite(&row[0], 1, row.size(), file);
+	}
+	fclose(file);
+	return true;
+}
+
+#ifdef __linux__
+/* post: an OpenGL context without a window is current. Mesa's surfaceless
+   platform is preferred since it needs no display server (e.g. llvmpipe on
+   render nodes). The context renders to framebuffer objects, so it is made
+   current without a surface when EGL_KHR_surfaceless_context is available,
+   and with a 1x1 pbuffer otherwise. */
+static bool CreateHeadlessContext(EGLDisplay *display, EGLContext *context, EGLSurface *surface)
+{
+	*display = EGL_NO_DISPLAY;
+	*context = EGL_NO_CONTEXT;
+	*surface = EGL_NO_SURFACE;
+
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+		(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+	if (getPlatformDisplay)
+		*display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+#endif
+	if (*display == EGL_NO_DISPLAY)
+		*display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+	EGLint major, minor;
+	if (*display == EGL_NO_DISPLAY || !eglInitialize(*display, &major, &minor))
+	{
+		fprintf(stderr, "Failed to initialize EGL\n");
+		return false;
+	}
+
+	const char *extensions = eglQueryString(*display, EGL_EXTENSIONS);
+	bool surfaceless = extensions && strstr(extensions, "EGL_KHR_surfaceless_context");
+	const EGLint configAttributes[] = {
+		EGL_SURFACE_TYPE, surfaceless ? 0 : EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_RED_SIZE, 8,
+		EGL_GREEN_SIZE, 8,
+		EGL_BLUE_SIZE, 8,
+		EGL_ALPHA_SIZE, 8,
+		EGL_DEPTH_SIZE, 24,
+		EGL_NONE
+	};
+	EGLConfig config;
+	EGLint configCount = 0;
+	if (!eglChooseConfig(*display, configAttributes, &config, 1, &configCount) || configCount == 0)
+	{
+		fprintf(stderr, "No EGL config supports desktop OpenGL%s\n", surfaceless ? "" : " pbuffers");
+		return false;
+	}
+	if (!eglBindAPI(EGL_OPENGL_API))
+	{
+		fprintf(stderr, "EGL does not support desktop OpenGL\n");
+		return false;
+	}
+
+	// Same versions as the window: 4.3 core for the wavefront path, else 3.3 core
+	const EGLint versions[2][2] = { { 4, 3 }, { 3, 3 } };
+	for (int i = 0; i < 2 && *context == EGL_NO_CONTEXT; i++)
+	{
+		const EGLint contextAttributes[] = {
+			EGL_CONTEXT_MAJOR_VERSION, versions[i][0],
+			EGL_CONTEXT_MINOR_VERSION, versions[i][1],
+			EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+			EGL_NONE
+		};
+		*context = eglCreateContext(*display, config, EGL_NO_CONTEXT, contextAttributes);
+	}
+	if (*context == EGL_NO_CONTEXT)
+	{
+		fprintf(stderr, "Failed to create an OpenGL 3.3 core context\n");
+		return false;
+	}
+
+	if (!surfaceless)
+	{
+		const EGLint pbufferAttributes[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+		*surface = eglCreatePbufferSurface(*display, config, pbufferAttributes);
+		if (*surface == EGL_NO_SURFACE)
+		{
+			fprintf(stderr, "Failed to create an EGL pbuffer (error 0x%04x)\n", eglGetError());
+			return false;
+		}
+	}
+	if (!eglMakeCurrent(*display, *surface, *surface, *context))
+	{
+		fprintf(stderr, "Failed to make the headless context current\n");
+		return false;
+	}
+	return true;
+}
+#endif
+
+/* post: render one image offscreen as set up on the command line, write it
+   and its frame times, and return the process exit code */
+static int RunHeadless(int argc, char *argv[])
+{
+#ifdef __linux__
+	EGLDisplay display;
+	EGLContext context;
+	EGLSurface surface;
+	if (!CreateHeadlessContext(&display, &context, &surface))
+		return 1;
+
+	// GLEW may report a missing GLX display here, the entry points are loaded regardless
+	glewExperimental = GL_TRUE;
+	glewInit();
+	printf("GL version: %s\nGL renderer: %s\n", glGetString(GL_VERSION), glGetString(GL_RENDERER));
+
+	FrameClock::time_point setupStart = FrameClock::now();
+	onInit(argc, argv);
+
+	// Progressive accumulation adds one sample per frame; a single sample is a full frame
+	frameMode = headlessSamples > 1 ? FRAME_MODE_PROGRESSIVE : FRAME_MODE_FULL;
+	maxAccumulatedSamples = headlessSamples;
+	// The frame mode must not change the shading, so runs with different
+	// sample counts measure the same work per sample
+	if (softShadowMode < 0)
+		softShadowMode = 0;
+	adaptiveSampling = false;
+	dynamicResolution = false;
+	double setupMs = std::chrono::duration<double, std::milli>(FrameClock::now() - setupStart).count();
+
+	// Every frame is finished before the next starts, so each time covers one
+	// frame's GPU work. The first frame also compiles the ray tracing program.
+	std::vector<double> frameMs;
+	for (int i = 0; i < headlessSamples; i++)
+	{
+		FrameClock::time_point start = FrameClock::now();
+		RenderRayTracing();
+		glFinish();
+		frameMs.push_back(std::chrono::duration<double, std::milli>(FrameClock::now() - start).count());
+	}
+
+	// Present into an 8-bit target and read it back
+	int width = theWindowWidth, height = theWindowHeight;
+	const GLenum format = GL_RGBA8;
+	GLuint imageTexture;
+	GpuRenderTargets("headlessImage", 1, &format, width, height, &imageTexture);
+	PresentRayTracing();
+	std::vector<unsigned char> pixels(width * height * 4);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, &pixels[0]);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	GpuReleaseRenderTarget("headlessImage");
+
+	bool written = WritePPM(headlessImagePath, pixels, width, height);
+	if (written)
+		printf("Wrote %d x %d image with %d samples to %s\n", width, height, headlessSamples, headlessImagePath);
+
+	double totalMs = 0.0;
+	for (size_t i = 0; i < frameMs.size(); i++)
+		totalMs += frameMs[i];
+	FILE *timing = fopen(headlessTimingPath, "w");
+	if (timing)
+	{
+		fprintf(timing, "{\n");
+		fprintf(timing, "  \"renderer\": %s,\n", JsonString((const char *)glGetString(GL_RENDERER)).c_str());
+		fprintf(timing, "  \"model\": %s,\n", JsonString(offFilePath).c_str());
+		fprintf(timing, "  \"scene\": %s,\n", JsonString(sceneName).c_str());
+		fprintf(timing, "  \"width\": %d,\n", width);
+		fprintf(timing, "  \"height\": %d,\n", height);
+		fprintf(timing, "  \"bounces\": %d,\n", enableReflections ? maxBounces : 0);
+		fprintf(timing, "  \"samples\": %d,\n", headlessSamples);
+		fprintf(timing, "  \"shadows\": \"%s\",\n", softShadowMode ? "soft" : "hard");
+		fprintf(timing, "  \"lights\": %d,\n", (int)lights.size());
+		fprintf(timing, "  \"setup_ms\": %.3f,\n", setupMs);
+		fprintf(timing, "  \"total_ms\": %.3f,\n", totalMs);
+		fprintf(timing, "  \"first_frame_ms\": %.3f,\n", frameMs[0]);
+		fprintf(timing, "  \"mean_frame_ms\": %.3f,\n",
+				frameMs.size() > 1 ? (totalMs - frameMs[0]) / (frameMs.size() - 1) : frameMs[0]);
+		fprintf(timing, "  \"frames_ms\": [");
+		for (size_t i = 0; i < frameMs.size(); i++)
+			fprintf(timing, "%s%.3f", i > 0 ? ", " : "", frameMs[i]);
+		fprintf(timing, "]\n");
+		fprintf(timing, "}\n");
+		fclose(timing);
+		printf("Wrote frame times to %s\n", headlessTimingPath);
+	}
+	else
+	{
+		fprintf(stderr, "Failed to write frame times to %s\n", headlessTimingPath);
+		written = false;
+	}
+
+	onShutdown();
+	eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	eglDestroyContext(display, context);
+	if (surface != EGL_NO_SURFACE)
+		eglDestroySurface(display, surface);
+	eglTerminate(display);
+	return written ? 0 : 1;
+#else
+	fprintf(stderr, "Headless mode needs EGL, which is only available on Linux\n");
+	return 1;
+#endif
+}
+
 // Define main function
 int main(int argc, char *argv[])
 {
+	ParseCommandLine(argc, argv);
+	if (headless)
+		return RunHeadless(argc, argv);
+
 	// Initialize GLFW
 	glfwInit();
 
-	// Define version and compatibility settings
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
+	// Define version and compatibility settings. A 4.3 context enables the
+	// compute wavefront path; without one the 3.3 fragment path is used.
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 	glfwWindowHint(GLFW_RESIZABLE, GL_TRUE);  // Allow resizing for better aspect ratio control
 
 	// Create OpenGL window and context
-	GLFWwindow *window = glfwCreateWindow(800, 800, "OpenGL", NULL, NULL);  // Use square window dimensions
+	GLFWwindow *window = glfwCreateWindow(theWindowWidth, theWindowHeight, theProgramTitle, NULL, NULL);
+	if (!window)
+	{
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+		window = glfwCreateWindow(theWindowWidth, theWindowHeight, theProgramTitle, NULL, NULL);
+	}
 	glfwMakeContextCurrent(window);
 
 	// Check for window creation failure
@@ -1010,23 +3507,32 @@ int main(int argc, char *argv[])
 		glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 		glClear(GL_COLOR_BUFFER_BIT);
 
+		FrameStatsBeginFrame(frameStats);
+		GpuProfilerBeginFrame(gpuProfiler);
+		for (int i = 0; i < gpuProfiler.completedFrames; i++)
+			FrameStatsAddGpu(frameStats, gpuProfiler.completedFrameMs[i]);
 		onDisplay();
 
+		GpuProfilerBeginSection(gpuProfiler, PROFILE_IMGUI);
 		RenderImGui();
+		GpuProfilerEndSection(gpuProfiler, PROFILE_IMGUI);
+		GpuProfilerEndFrame(gpuProfiler);
+		FrameStatsEndFrame(frameStats);
+		UpdateWindowTitle(window);
 
 		glfwSwapBuffers(window);
-		glfwPollEvents();
+
+		// Nothing was traced this frame, so block until input arrives (or the
+		// timeout passes) and only the ImGui overlay needs to be redrawn
+		if (useRayTracing && !rayTraceImageUpdated)
+			glfwWaitEventsTimeout(idleWaitSeconds);
+		else
+			glfwPollEvents();
 	}
 
-	// Clean up OpenGL resources
-	glDeleteVertexArrays(1, &VAO);
-	glDeleteBuffers(1, &VBO);
-	glDeleteBuffers(1, &IBO);
+	ExportFrameStats();
 
-	// Free the model
-	if (model) {
-		FreeOffModel(model);
-	}
+	onShutdown();
 
 	// Clean up ImGui
 	ImGui_ImplOpenGL3_Shutdown();
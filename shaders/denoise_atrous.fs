@@ -0,0 +1,90 @@
+#version 330 core
+layout(location = 0) out vec4 FragColor;
+
+in vec2 TexCoords;
+
+// One iteration of the edge-avoiding a-trous wavelet filter: a 5x5 B3 spline
+// kernel whose taps are stepSize pixels apart. Taps are weighted down across
+// edges in luminance (relative to the filtered standard deviation), normal,
+// position and albedo. The variance in alpha is filtered along, so each
+// iteration sees the noise left by the previous one.
+uniform sampler2D illuminationTexture;   // rgb = demodulated color, a = variance
+uniform sampler2D positionTexture;
+uniform sampler2D normalTexture;
+uniform sampler2D albedoTexture;
+uniform int stepSize;
+uniform vec3 eyePosition;
+uniform float pixelFootprint;            // size of a pixel at distance 1
+uniform int modulate;                    // last iteration: multiply the albedo back in
+
+const float kernel[3] = float[3](3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0);
+const float sigmaLuminance = 4.0;
+const float sigmaNormal = 128.0;
+const float sigmaPosition = 2.0;
+const float sigmaAlbedo = 10.0;
+
+float luminance(vec3 color)
+{
+    return dot(color, vec3(0.299, 0.587, 0.114));
+}
+
+void main()
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    ivec2 maxPixel = textureSize(illuminationTexture, 0) - 1;
+    vec4 center = texelFetch(illuminationTexture, pixel, 0);
+    vec4 position = texelFetch(positionTexture, pixel, 0);
+    vec3 normal = texelFetch(normalTexture, pixel, 0).xyz;
+    vec3 albedo = texelFetch(albedoTexture, pixel, 0).rgb;
+    
+    // The background has nothing to filter
+    if (position.w == 0.0) {
+        FragColor = modulate != 0 ? vec4(center.rgb * albedo, 1.0) : center;
+        return;
+    }
+    
+    // Standard deviation of the luminance, blurred over 3x3 for stability
+    float variance = 0.0;
+    const float gaussian[2] = float[2](1.0 / 4.0, 1.0 / 8.0);
+    for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+            ivec2 q = clamp(pixel + ivec2(dx, dy), ivec2(0), maxPixel);
+            variance += gaussian[abs(dx)] * gaussian[abs(dy)] * 4.0 * texelFetch(illuminationTexture, q, 0).a;
+        }
+    }
+    float luminanceScale = sigmaLuminance * sqrt(max(variance, 0.0)) + 1e-4;
+    float positionScale = sigmaPosition * float(stepSize) * pixelFootprint * distance(eyePosition, position.xyz) + 1e-4;
+    float centerLuminance = luminance(center.rgb);
+    
+    vec3 sumColor = vec3(0.0);
+    float sumVariance = 0.0;
+    float sumWeight = 0.0;
+    for (int dy = -2; dy <= 2; dy++) {
+        for (int dx = -2; dx <= 2; dx++) {
+            ivec2 q = pixel + ivec2(dx, dy) * stepSize;
+            if (any(lessThan(q, ivec2(0))) || any(greaterThan(q, maxPixel))) continue;
+            
+            vec4 tap = texelFetch(illuminationTexture, q, 0);
+            vec4 tapPosition = texelFetch(positionTexture, q, 0);
+            if (tapPosition.w == 0.0) continue;
+            vec3 tapNormal = texelFetch(normalTexture, q, 0).xyz;
+            vec3 tapAlbedo = texelFetch(albedoTexture, q, 0).rgb;
+            
+            float weightLuminance = abs(luminance(tap.rgb) - centerLuminance) / luminanceScale;
+            float weightPosition = distance(tapPosition.xyz, position.xyz) / positionScale;
+            float weightAlbedo = sigmaAlbedo * distance(tapAlbedo, albedo);
+            float weight = kernel[abs(dx)] * kernel[abs(dy)] *
+                           pow(max(dot(tapNormal, normal), 0.0), sigmaNormal) *
+                           exp(-weightLuminance - weightPosition - weightAlbedo);
+            
+            sumColor += weight * tap.rgb;
+            sumVariance += weight * weight * tap.a;
+            sumWeight += weight;
+        }
+    }
+    
+    // The center tap always has a positive weight
+    vec3 color = sumColor / sumWeight;
+    float filteredVariance = sumVariance / (sumWeight * sumWeight);
+    FragColor = modulate != 0 ? vec4(color * albedo, 1.0) : vec4(color, filteredVariance);
+}
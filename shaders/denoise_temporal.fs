@@ -0,0 +1,96 @@
+#version 330 core
+layout(location = 0) out vec4 Illumination;   // rgb = demodulated color, a = luminance variance
+layout(location = 1) out vec4 Moments;        // luminance moments and history length
+
+in vec2 TexCoords;
+
+// First stage of the denoiser: the 1 spp frame is divided by the albedo of
+// the primary hit and blended with the reprojected history of earlier frames.
+// History is rejected where the previous frame saw a different surface.
+uniform sampler2D currentColor;
+uniform sampler2D currentPosition;    // primary hit, w = 1 on a hit
+uniform sampler2D currentNormal;
+uniform sampler2D currentAlbedo;
+uniform sampler2D historyIllumination;
+uniform sampler2D historyMoments;
+uniform sampler2D previousPosition;
+uniform sampler2D previousNormal;
+uniform mat4 previousViewProjection;
+uniform vec3 eyePosition;
+uniform int historyValid;
+uniform float colorAlpha;             // weight of the new frame once the history is long
+uniform float momentsAlpha;
+
+float luminance(vec3 color)
+{
+    return dot(color, vec3(0.299, 0.587, 0.114));
+}
+
+vec3 demodulate(ivec2 pixel)
+{
+    vec3 albedo = texelFetch(currentAlbedo, pixel, 0).rgb;
+    return texelFetch(currentColor, pixel, 0).rgb / max(albedo, vec3(0.001));
+}
+
+void main()
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    ivec2 size = textureSize(currentColor, 0);
+    vec3 illumination = demodulate(pixel);
+    float l = luminance(illumination);
+    vec4 position = texelFetch(currentPosition, pixel, 0);
+    vec3 normal = texelFetch(currentNormal, pixel, 0).xyz;
+    
+    // Previous pixel of the surface, accepted if it lies on the same surface
+    bool reprojected = false;
+    ivec2 previousPixel = pixel;
+    if (historyValid != 0 && position.w > 0.0) {
+        vec4 clip = previousViewProjection * vec4(position.xyz, 1.0);
+        previousPixel = ivec2(floor((clip.xy / clip.w * 0.5 + 0.5) * vec2(size)));
+        if (clip.w > 0.0 && all(greaterThanEqual(previousPixel, ivec2(0))) && all(lessThan(previousPixel, size))) {
+            vec4 oldPosition = texelFetch(previousPosition, previousPixel, 0);
+            vec3 oldNormal = texelFetch(previousNormal, previousPixel, 0).xyz;
+            float tolerance = 0.02 * distance(eyePosition, position.xyz);
+            reprojected = oldPosition.w > 0.0 && distance(oldPosition.xyz, position.xyz) < tolerance &&
+                          dot(oldNormal, normal) > 0.9;
+        }
+    } else if (historyValid != 0) {
+        // Background stays put as long as the view does not change
+        reprojected = texelFetch(previousPosition, pixel, 0).w == 0.0;
+    }
+    
+    vec4 moments = vec4(l, l * l, 1.0, 0.0);
+    if (reprojected) {
+        vec4 oldMoments = texelFetch(historyMoments, previousPixel, 0);
+        vec3 oldIllumination = texelFetch(historyIllumination, previousPixel, 0).rgb;
+        float historyLength = min(oldMoments.z + 1.0, 64.0);
+        float alpha = max(colorAlpha, 1.0 / historyLength);
+        float alphaMoments = max(momentsAlpha, 1.0 / historyLength);
+        illumination = mix(oldIllumination, illumination, alpha);
+        moments = vec4(mix(oldMoments.xy, moments.xy, alphaMoments), historyLength, 0.0);
+    }
+    
+    float variance;
+    if (moments.z >= 4.0) {
+        variance = max(moments.y - moments.x * moments.x, 0.0);
+    } else {
+        // Too little history, estimate the variance from the neighborhood
+        // of pixels on the same surface
+        vec2 sum = vec2(0.0);
+        float count = 0.0;
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                ivec2 q = clamp(pixel + ivec2(dx, dy), ivec2(0), size - 1);
+                if (dot(texelFetch(currentNormal, q, 0).xyz, normal) < 0.9) continue;
+                float lq = luminance(demodulate(q));
+                sum += vec2(lq, lq * lq);
+                count += 1.0;
+            }
+        }
+        sum /= max(count, 1.0);
+        variance = max(sum.y - sum.x * sum.x, 0.0) * 4.0 / moments.z;
+    }
+    
+    Illumination = vec4(illumination, variance);
+    Moments = moments;
+}
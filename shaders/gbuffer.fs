@@ -0,0 +1,47 @@
+#version 330 core
+layout(location = 0) out vec4 GPosition;   // world position, w = 1 where a primitive was hit
+layout(location = 1) out vec4 GNormal;     // world normal, w = primitive id (see PRIMITIVES_PER_TYPE)
+
+in vec3 worldPosition;
+
+#include "rt_common.glsl"
+
+// Hybrid primary visibility: every primitive is rasterized instead of traced.
+// Spheres and boxes are drawn as bounding cubes and intersected analytically
+// along the camera ray, so their surfaces match the ray tracer exactly; mesh
+// triangles are used as they are.
+uniform int primitive;       // primitive id of the drawn object
+uniform mat4 viewProjection;
+
+void main()
+{
+    int type = primitive / PRIMITIVES_PER_TYPE;
+    int index = primitive % PRIMITIVES_PER_TYPE;
+    vec3 position = worldPosition;
+    vec3 normal;
+    
+    if (type == PRIMITIVE_MESH) {
+        normal = normalize(cross(dFdx(worldPosition), dFdy(worldPosition)));
+        if (dot(normal, worldPosition - cameraPosition) > 0.0) {
+            normal = -normal;
+        }
+        gl_FragDepth = gl_FragCoord.z;
+    } else {
+        Ray ray;
+        ray.origin = cameraPosition;
+        ray.direction = normalize(worldPosition - cameraPosition);
+        float t = type == PRIMITIVE_SPHERE ? sphereDistance(ray, sphereGeometry[index], 1e30)
+                                           : boxDistance(ray, boxMin[index].xyz, boxMax[index].xyz, 1e30);
+        if (t < 0.0) {
+            discard;
+        }
+        position = ray.origin + t * ray.direction;
+        normal = type == PRIMITIVE_SPHERE ? normalize(position - sphereGeometry[index].xyz)
+                                          : boxNormal(position, boxMin[index].xyz, boxMax[index].xyz);
+        vec4 clip = viewProjection * vec4(position, 1.0);
+        gl_FragDepth = clamp(clip.z / clip.w * 0.5 + 0.5, 0.0, 1.0);
+    }
+    
+    GPosition = vec4(position, 1.0);
+    GNormal = vec4(normal, float(primitive));
+}
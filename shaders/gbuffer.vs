@@ -0,0 +1,15 @@
+#version 330 core
+layout(location = 0) in vec3 Position;
+
+// Rasterizes one scene object into the hybrid G-buffer (see gbuffer.fs)
+uniform mat4 gWorld;
+uniform mat4 viewProjection;
+
+out vec3 worldPosition;
+
+void main()
+{
+    vec4 worldPos = gWorld * vec4(Position, 1.0);
+    worldPosition = worldPos.xyz;
+    gl_Position = viewProjection * worldPos;
+}
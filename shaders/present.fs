@@ -0,0 +1,51 @@
+#version 330 core
+out vec4 FragColor;
+
+in vec2 TexCoords;
+
+// Cached ray-traced image in linear color. It may be smaller than the window
+// when dynamic resolution is active.
+uniform sampler2D sourceTexture;
+uniform vec2 sourceSize;
+uniform float edgeSharpness;   // 0 gives plain bilinear upscaling
+
+float luminance(vec3 color)
+{
+    return dot(color, vec3(0.299, 0.587, 0.114));
+}
+
+// Edge-aware upscale: the four texels of the bilinear footprint are weighted
+// by how close their luminance is to the footprint's median, so texels on the
+// other side of an edge contribute less and edges stay sharp.
+vec3 upscale(vec2 uv)
+{
+    vec2 position = uv * sourceSize - 0.5;
+    vec2 base = floor(position);
+    vec2 f = position - base;
+    ivec2 maxTexel = ivec2(sourceSize) - 1;
+
+    vec3 c00 = texelFetch(sourceTexture, clamp(ivec2(base), ivec2(0), maxTexel), 0).rgb;
+    vec3 c10 = texelFetch(sourceTexture, clamp(ivec2(base) + ivec2(1, 0), ivec2(0), maxTexel), 0).rgb;
+    vec3 c01 = texelFetch(sourceTexture, clamp(ivec2(base) + ivec2(0, 1), ivec2(0), maxTexel), 0).rgb;
+    vec3 c11 = texelFetch(sourceTexture, clamp(ivec2(base) + ivec2(1, 1), ivec2(0), maxTexel), 0).rgb;
+
+    vec4 bilinear = vec4((1.0 - f.x) * (1.0 - f.y), f.x * (1.0 - f.y), (1.0 - f.x) * f.y, f.x * f.y);
+    vec4 luma = vec4(luminance(c00), luminance(c10), luminance(c01), luminance(c11));
+
+    // Median of four values: average of the two middle ones
+    float lo = min(min(luma.x, luma.y), min(luma.z, luma.w));
+    float hi = max(max(luma.x, luma.y), max(luma.z, luma.w));
+    float median = (luma.x + luma.y + luma.z + luma.w - lo - hi) * 0.5;
+
+    vec4 similarity = 1.0 / (1.0 + edgeSharpness * abs(luma - median) / (median + 0.05));
+    vec4 weights = bilinear * similarity;
+    weights /= max(dot(weights, vec4(1.0)), 1e-5);
+
+    return c00 * weights.x + c10 * weights.y + c01 * weights.z + c11 * weights.w;
+}
+
+void main()
+{
+    vec3 color = upscale(TexCoords);
+    FragColor = vec4(pow(color, vec3(1.0/2.2)), 1.0); // Gamma correction
+}
@@ -1,352 +1,134 @@
 #version 330 core
-out vec4 FragColor;
+layout(location = 0) out vec4 FragColor;
+layout(location = 1) out vec4 PrimaryHit;   // world position of the primary hit, w = 1 on a hit
+layout(location = 2) out vec4 Moments;      // mean luminance, mean squared luminance, sample count
+layout(location = 3) out vec4 Normal;       // normal of the primary hit, for the denoiser
+layout(location = 4) out vec4 Albedo;       // color of the primary hit, 1 for the background
 
 in vec2 TexCoords;
 
-uniform vec3 cameraPosition;
-uniform mat4 viewMatrix;
-uniform mat4 projectionMatrix;
-uniform float screenWidth;
-uniform float screenHeight;
-uniform bool enableShadows;
-uniform bool enableReflections;
-uniform int maxBounces;
-uniform float reflectivity;
-
-// Scene objects
-#define MAX_OBJECTS 16
-#define OBJECT_TYPE_SPHERE 0
-#define OBJECT_TYPE_CUBE 1
-#define OBJECT_TYPE_MESH 2
-
-struct Object {
-    int type;
-    vec3 position;
-    vec3 size;        // radius for sphere, half-size for cube
-    vec3 color;
-    float reflectivity;
-};
-
-uniform Object objects[MAX_OBJECTS];
-uniform int numObjects;
-
-// Mesh data stored in texture
-uniform sampler2D meshDataTexture;
-uniform int numTriangles;
-uniform int meshObjectIndex; // Index of the mesh object in the objects array
-uniform int meshTextureSize;
-
-// Light properties
-#define MAX_LIGHTS 4
-struct Light {
-    vec3 position;
-    vec3 color;
-    float intensity;
-};
-
-uniform Light lights[MAX_LIGHTS];
-uniform int numLights;
-uniform vec3 ambientLight;
-
-// Ray structure
-struct Ray {
-    vec3 origin;
-    vec3 direction;
-};
-
-// Triangle structure for Möller-Trumbore algorithm
-struct Triangle {
-    vec3 v0;
-    vec3 v1;
-    vec3 v2;
-    vec3 normal;
-};
-
-// Hit information
-struct HitInfo {
-    bool hit;
-    float t;
-    vec3 position;
-    vec3 normal;
-    vec3 color;
-    float reflectivity;
-};
-
-// Function to fetch triangle data from texture
-Triangle getTriangleFromTexture(int triangleIndex) {
-    Triangle tri;
-    
-    // Each triangle uses 3 texels (12 floats total)
-    // Texture width is 4 texels, so each row is one triangle
-    int textureWidth = 4;
-    
-    // Calculate texture coordinates
-    int row = triangleIndex;
-    
-    // Read vertex 0 (first texel, xyz)
-    vec4 texel0 = texelFetch(meshDataTexture, ivec2(0, row), 0);
-    tri.v0 = texel0.xyz;
-    
-    // Read vertex 1 (first texel w component + second texel xy)
-    vec4 texel1 = texelFetch(meshDataTexture, ivec2(1, row), 0);
-    tri.v1 = vec3(texel0.w, texel1.xy);
-    
-    // Read vertex 2 (second texel zw + third texel x)
-    vec4 texel2 = texelFetch(meshDataTexture, ivec2(2, row), 0);
-    tri.v2 = vec3(texel1.zw, texel2.x);
-    
-    // Read normal (third texel yzw)
-    tri.normal = vec3(texel2.yzw);
-    
-    return tri;
-}
-
-// Ray-Sphere intersection
-bool intersectSphere(Ray ray, Object sphere, out HitInfo hitInfo) {
-    vec3 oc = ray.origin - sphere.position;
-    float a = dot(ray.direction, ray.direction);
-    float b = 2.0 * dot(oc, ray.direction);
-    float c = dot(oc, oc) - sphere.size.x * sphere.size.x;
-    float discriminant = b * b - 4.0 * a * c;
-    
-    if (discriminant < 0.0) {
+#include "rt_common.glsl"
+
+// Progressive accumulation: sample sampleIndex of the current view is averaged
+// with the previous samples stored in historyTexture. Sample 0 starts a new image.
+uniform int sampleIndex;
+uniform sampler2D historyTexture;
+
+// Varies the random numbers of frames that all trace sample 0, as the denoiser does
+uniform int randomSeed;
+
+// Adaptive sampling: historyMoments holds each pixel's luminance moments and
+// sample count. With adaptiveSampling set, pixels in tiles of maskTileSize
+// that sampleMask marks as converged (0) keep their history instead of tracing.
+uniform sampler2D historyMoments;
+uniform sampler2D sampleMask;
+uniform int adaptiveSampling;
+uniform int maskTileSize;
+
+// Temporal reprojection: when temporalEnabled is set, pixels whose surface was
+// visible in the previous frame reuse its color instead of being traced.
+// previousColor / previousHit are the previous frame's outputs, and
+// previousViewProjection maps world positions to its clip space.
+uniform int temporalEnabled;
+uniform int temporalFrame;          // rotates the pixels that are always re-traced
+uniform int temporalRefreshPeriod;  // one pixel in this many is re-traced per frame
+uniform mat4 previousViewProjection;
+uniform sampler2D previousColor;
+uniform sampler2D previousHit;
+
+// Interlaced tracing: with interlacePhases > 1 only the pixels of phase
+// interlacePhase are traced, the others keep their samples from earlier frames
+uniform int interlacePhases;
+uniform int interlacePhase;
+
+// Hybrid mode (hybridPrimary in the SettingsBlock): primary hits are read from
+// the rasterized G-buffer, see gbuffer.fs
+uniform sampler2D gbufferPosition;
+uniform sampler2D gbufferNormal;
+
+// Primary hit of the pixel according to the G-buffer
+bool gbufferHit(ivec2 pixel, out HitInfo hitInfo) {
+    vec4 position = texelFetch(gbufferPosition, pixel, 0);
+    hitInfo.hit = position.w > 0.0;
+    if (!hitInfo.hit) {
         return false;
     }
-    
-    float t = (-b - sqrt(discriminant)) / (2.0 * a);
-    if (t < 0.001) {
-        t = (-b + sqrt(discriminant)) / (2.0 * a);
-        if (t < 0.001) {
-            return false;
-        }
-    }
-    
-    hitInfo.hit = true;
-    hitInfo.t = t;
-    hitInfo.position = ray.origin + t * ray.direction;
-    hitInfo.normal = normalize(hitInfo.position - sphere.position);
-    hitInfo.color = sphere.color;
-    hitInfo.reflectivity = sphere.reflectivity;
-    
+    vec4 normal = texelFetch(gbufferNormal, pixel, 0);
+    int id = int(normal.w + 0.5);
+    vec4 material = primitiveMaterial(id / PRIMITIVES_PER_TYPE, id % PRIMITIVES_PER_TYPE);
+    hitInfo.t = distance(cameraPosition, position.xyz);
+    hitInfo.position = position.xyz;
+    hitInfo.normal = normalize(normal.xyz);
+    hitInfo.color = material.rgb;
+    hitInfo.reflectivity = material.a;
     return true;
 }
 
-// Ray-AABB (cube) intersection
-bool intersectCube(Ray ray, Object cube, out HitInfo hitInfo) {
-    vec3 tMin = (cube.position - cube.size - ray.origin) / ray.direction;
-    vec3 tMax = (cube.position + cube.size - ray.origin) / ray.direction;
-    
-    vec3 t1 = min(tMin, tMax);
-    vec3 t2 = max(tMin, tMax);
-    
-    float tNear = max(max(t1.x, t1.y), t1.z);
-    float tFar = min(min(t2.x, t2.y), t2.z);
-    
-    if (tNear > tFar || tFar < 0.0) {
-        return false;
-    }
-    
-    float t = tNear > 0.001 ? tNear : tFar;
-    if (t < 0.001) {
-        return false;
-    }
-    
-    hitInfo.hit = true;
-    hitInfo.t = t;
-    hitInfo.position = ray.origin + t * ray.direction;
-    
-    // Calculate normal based on which face was hit
-    vec3 pc = hitInfo.position - cube.position;
-    vec3 absPC = abs(pc);
-    
-    if (absPC.x > absPC.y && absPC.x > absPC.z) {
-        hitInfo.normal = vec3(sign(pc.x), 0.0, 0.0);
-    } else if (absPC.y > absPC.z) {
-        hitInfo.normal = vec3(0.0, sign(pc.y), 0.0);
-    } else {
-        hitInfo.normal = vec3(0.0, 0.0, sign(pc.z));
-    }
-    
-    hitInfo.color = cube.color;
-    hitInfo.reflectivity = cube.reflectivity;
-    
-    return true;
-}
-
-// Ray-Triangle intersection using Möller-Trumbore algorithm
-bool intersectTriangle(Ray ray, Triangle triangle, out HitInfo hitInfo) {
-    const float EPSILON = 0.0000001;
-    
-    vec3 edge1 = triangle.v1 - triangle.v0;
-    vec3 edge2 = triangle.v2 - triangle.v0;
-    vec3 h = cross(ray.direction, edge2);
-    float a = dot(edge1, h);
-    
-    if (abs(a) < EPSILON)
-        return false;    // Ray is parallel to triangle
-    
-    float f = 1.0 / a;
-    vec3 s = ray.origin - triangle.v0;
-    float u = f * dot(s, h);
-    
-    if (u < 0.0 || u > 1.0)
-        return false;
-    
-    vec3 q = cross(s, edge1);
-    float v = f * dot(ray.direction, q);
-    
-    if (v < 0.0 || u + v > 1.0)
-        return false;
-    
-    // At this stage, we can compute t to find out where the intersection point is on the line
-    float t = f * dot(edge2, q);
-    
-    if (t > EPSILON) {
-        hitInfo.hit = true;
-        hitInfo.t = t;
-        hitInfo.position = ray.origin + ray.direction * t;
-        
-        // Calculate the normal
-        if (length(triangle.normal) > 0.0) {
-            // Use the pre-computed normal if available
-            hitInfo.normal = normalize(triangle.normal);
-        } else {
-            // Calculate normal from vertices
-            hitInfo.normal = normalize(cross(edge1, edge2));
-        }
-        
-        // Ensure normal faces the right direction
-        if (dot(ray.direction, hitInfo.normal) > 0.0) {
-            hitInfo.normal = -hitInfo.normal;
-        }
-        
-        return true;
-    }
-    
-    return false;
-}
-
-// Ray-Mesh intersection
-bool intersectMesh(Ray ray, Object meshObj, out HitInfo hitInfo) {
-    bool hit = false;
-    hitInfo.hit = false;
-    hitInfo.t = 1e30; // Large number
-    
-    // Apply mesh object position transformation to ray
-    Ray localRay;
-    localRay.origin = ray.origin - meshObj.position;
-    localRay.direction = ray.direction;
-    
-    // Iterate over all triangles in the mesh
-    for (int i = 0; i < numTriangles; i++) {
-        // Get triangle data from texture
-        Triangle tri = getTriangleFromTexture(i);
-        
-        HitInfo tempHitInfo;
-        if (intersectTriangle(localRay, tri, tempHitInfo)) {
-            if (tempHitInfo.t < hitInfo.t) {
-                hitInfo = tempHitInfo;
-                hitInfo.color = meshObj.color;
-                hitInfo.reflectivity = meshObj.reflectivity;
-                hit = true;
-            }
-        }
-    }
-    
-    // Transform intersection point and normal back to world space
-    if (hit) {
-        hitInfo.position = hitInfo.position + meshObj.position;
-    }
-    
-    return hit;
-}
-
-// Get the closest hit among all objects
-bool traceRay(Ray ray, out HitInfo hitInfo, int skipObjectIndex) {
-    hitInfo.hit = false;
-    hitInfo.t = 1e30; // Large number
-    
-    for (int i = 0; i < numObjects; i++) {
-        if (i == skipObjectIndex) continue;
-        
-        HitInfo tempHitInfo;
-        bool hit = false;
-        
-        if (objects[i].type == OBJECT_TYPE_SPHERE) {
-            hit = intersectSphere(ray, objects[i], tempHitInfo);
-        } else if (objects[i].type == OBJECT_TYPE_CUBE) {
-            hit = intersectCube(ray, objects[i], tempHitInfo);
-        } else if (objects[i].type == OBJECT_TYPE_MESH && i == meshObjectIndex) {
-            hit = intersectMesh(ray, objects[i], tempHitInfo);
-        }
-        
-        if (hit && tempHitInfo.t < hitInfo.t) {
-            hitInfo = tempHitInfo;
-        }
-    }
-    
-    return hitInfo.hit;
-}
-
-// Check if a point is in shadow
-bool isInShadow(vec3 point, vec3 lightPosition) {
-    vec3 lightDir = normalize(lightPosition - point);
-    float lightDistance = length(lightPosition - point);
-    
-    Ray shadowRay;
-    shadowRay.origin = point + 0.001 * lightDir; // Offset to avoid self-shadowing
-    shadowRay.direction = lightDir;
-    
-    HitInfo shadowHit;
-    if (traceRay(shadowRay, shadowHit, -1)) {
-        return shadowHit.t < lightDistance;
-    }
-    
-    return false;
+int interlacePhaseOf(ivec2 pixel)
+{
+    return interlacePhases == 2 ? ((pixel.x + pixel.y) & 1) : ((pixel.x & 1) + 2 * (pixel.y & 1));
 }
 
 // Main ray tracing function with reflections
-vec3 traceScene(Ray primaryRay) {
+vec3 traceScene(Ray primaryRay, out vec4 primaryHit) {
     vec3 finalColor = vec3(0.0);
+    primaryHit = vec4(0.0);
     vec3 throughput = vec3(1.0);
     Ray currentRay = primaryRay;
-    int bounceCount = 0;
-    int lastHitObject = -1;
     
-    while (bounceCount <= maxBounces) {
+    for (int bounceCount = 0; bounceCount <= MAX_BOUNCES; bounceCount++) {
         HitInfo hitInfo;
         
-        if (!traceRay(currentRay, hitInfo, lastHitObject)) {
+        bool rasterized = bounceCount == 0 && hybridPrimary != 0;
+        bool hit = rasterized ? gbufferHit(ivec2(gl_FragCoord.xy), hitInfo) : traceRay(currentRay, hitInfo);
+        if (rasterized && hit) {
+            // Reflections leave from the rasterized surface along the pixel's center ray
+            currentRay.direction = normalize(hitInfo.position - cameraPosition);
+        }
+        if (!hit) {
             // Ray missed any object, return background color
             finalColor += throughput * ambientLight * 0.5;
             break;
         }
+        if (bounceCount == 0) {
+            primaryHit = vec4(hitInfo.position, 1.0);
+            Normal = vec4(hitInfo.normal, 0.0);
+            Albedo = vec4(hitInfo.color, 1.0);
+        }
         
         // Calculate lighting (Phong model)
         vec3 ambient = ambientLight * hitInfo.color;
         vec3 diffuseAndSpecular = vec3(0.0);
         
-        for (int i = 0; i < numLights; i++) {
-            vec3 lightDir = normalize(lights[i].position - hitInfo.position);
-            float diffFactor = max(dot(lightDir, hitInfo.normal), 0.0);
+        // Primary hits shade every light of their cluster when light culling
+        // is on, other hits pick lights from the whole scene
+        bool clustered = bounceCount == 0 && lightCulling != 0;
+        ivec2 lightList = clustered ? lightClusterRange(ivec2(gl_FragCoord.xy), hitInfo.position) : ivec2(0, LIGHT_RAYS);
+        
+        for (int i = 0; i < lightList.y; i++) {
+            float weight = 1.0;
+            int lightIndex = clustered ? texelFetch(lightClusters, lightList.x + i).r : selectLight(i, hitInfo.position, weight);
+            Light light = fetchLight(lightIndex);
+            if (light.range > 0.0 && distance(light.position, hitInfo.position) >= light.range) {
+                continue;
+            }
+            vec3 lightDir = normalize(light.position - hitInfo.position);
             
-            // Shadow check
+            // Shadow check, from the shadow map for primary hits when the light has one
             bool shadowed = false;
-            if (enableShadows) {
-                shadowed = isInShadow(hitInfo.position, lights[i].position);
+            if (ENABLE_SHADOWS && bounceCount == 0 && lightIndex < shadowMapLights) {
+                shadowed = shadowMapOccluded(lightIndex, light.position, hitInfo.position, hitInfo.normal);
+            } else if (ENABLE_SHADOWS) {
+                // Soft shadows pick a random point on the light for each sample
+                vec3 shadowTarget = light.position;
+                if (softShadows != 0) {
+                    shadowTarget += light.radius * randomUnitVector();
+                }
+                shadowed = isInShadow(hitInfo.position, shadowTarget);
             }
             
             if (!shadowed) {
-                // Diffuse component
-                vec3 diffuse = diffFactor * lights[i].color * lights[i].intensity * hitInfo.color;
-                
-                // Specular component (Blinn-Phong)
-                vec3 viewDir = normalize(cameraPosition - hitInfo.position);
-                vec3 halfwayDir = normalize(lightDir + viewDir);
-                float spec = pow(max(dot(hitInfo.normal, halfwayDir), 0.0), 32.0);
-                vec3 specular = spec * lights[i].color * lights[i].intensity * 0.5;
-                
-                diffuseAndSpecular += diffuse + specular;
+                diffuseAndSpecular += weight * shadeLight(hitInfo, light, lightDir);
             }
         }
         
@@ -354,47 +136,109 @@ vec3 traceScene(Ray primaryRay) {
         finalColor += throughput * (ambient + diffuseAndSpecular);
         
         // Stop if we've reached max bounces or reflectivity is too low
-        if (!enableReflections || bounceCount >= maxBounces || hitInfo.reflectivity < 0.01) {
+        if (!ENABLE_REFLECTIONS || bounceCount >= MAX_BOUNCES || hitInfo.reflectivity < 0.01) {
             break;
         }
         
         // Set up reflection ray for next bounce
         currentRay.origin = hitInfo.position;
-        currentRay.direction = reflect(currentRay.direction, hitInfo.normal);
+        currentRay.direction = reflectionDirection(currentRay.direction, hitInfo.normal);
         
         // Adjust throughput for next bounce based on reflectivity
         throughput *= hitInfo.reflectivity;
-        bounceCount++;
     }
     
     return finalColor;
 }
 
+// Pixel of the previous frame that saw the same surface as the ray through the
+// current pixel. Starting from the previous hit at the same pixel, the guess is
+// moved onto the current ray, projected with the previous camera, and replaced
+// by the hit stored there; this converges in a few steps for smooth motion.
+// Returns false on disocclusion, i.e. when no previous pixel saw the surface.
+bool reprojectPixel(Ray ray, ivec2 pixel, out ivec2 previousPixel)
+{
+    ivec2 maxPixel = ivec2(screenSize) - 1;
+    vec4 guess = texelFetch(previousHit, pixel, 0);
+    previousPixel = pixel;
+    
+    for (int i = 0; i < 3; i++) {
+        // Background has no depth, follow the direction instead
+        float t = guess.w != 0.0 ? dot(guess.xyz - ray.origin, ray.direction) : 1e4;
+        if (t <= 0.0) return false;
+        vec3 position = ray.origin + ray.direction * t;
+        
+        vec4 clip = previousViewProjection * vec4(position, 1.0);
+        if (clip.w <= 0.0) return false;
+        vec2 uv = clip.xy / clip.w * 0.5 + 0.5;
+        if (any(lessThan(uv, vec2(0.0))) || any(greaterThanEqual(uv, vec2(1.0)))) return false;
+        previousPixel = clamp(ivec2(uv * screenSize), ivec2(0), maxPixel);
+        
+        vec4 previous = texelFetch(previousHit, previousPixel, 0);
+        if (previous.w == 0.0 && guess.w == 0.0) return true;
+        if (previous.w != 0.0) {
+            // Accept when the previous hit lies on the current ray
+            float along = dot(previous.xyz - ray.origin, ray.direction);
+            vec3 offset = previous.xyz - (ray.origin + ray.direction * along);
+            if (along > 0.0 && length(offset) < 0.002 * along + 1e-3) return true;
+        }
+        guess = previous;
+    }
+    return false;
+}
+
 void main() {
-    // Calculate the ray direction from camera through current fragment
-    float aspectRatio = screenWidth / screenHeight;
-    float fov = 45.0; // Match the perspective projection in the main program
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    Normal = vec4(0.0);
+    Albedo = vec4(1.0);
+    if (interlacePhases > 1 && interlacePhaseOf(pixel) != interlacePhase) {
+        discard;
+    }
     
-    vec2 uv = TexCoords * 2.0 - 1.0;
-    uv.x *= aspectRatio;
+    // Samples accumulated so far at this pixel
+    vec4 moments = sampleIndex > 0 ? texelFetch(historyMoments, pixel, 0) : vec4(0.0);
+    if (adaptiveSampling != 0 && texelFetch(sampleMask, pixel / maskTileSize, 0).r == 0.0) {
+        FragColor = texelFetch(historyTexture, pixel, 0);
+        Moments = moments;
+        return;
+    }
     
-    // Create the ray
-    Ray ray;
-    ray.origin = cameraPosition;
+    rngState = pcgHash(uint(pixel.x) ^ pcgHash(uint(pixel.y) ^ pcgHash(uint(sampleIndex) ^ pcgHash(uint(randomSeed)))));
     
-    // Calculate the ray direction in world space
-    float tanFov = tan(radians(fov) * 0.5);
-    vec3 rayDir = normalize(vec3(uv.x * tanFov, uv.y * tanFov, -1.0));
+    // The first sample goes through the pixel center, later ones are jittered
+    vec2 subpixel = sampleIndex == 0 ? vec2(0.5) : vec2(random01(), random01());
+    vec2 samplePosition = vec2(pixel) + subpixel;
     
-    // Transform ray direction from camera space to world space
-    mat4 invView = inverse(viewMatrix);
-    vec4 worldRayDir = invView * vec4(rayDir, 0.0);
-    ray.direction = normalize(worldRayDir.xyz);
+    // Ray from the camera through the sample position
+    Ray ray;
+    ray.origin = cameraPosition;
+    ray.direction = normalize(rayBase + samplePosition.x * pixelDeltaX + samplePosition.y * pixelDeltaY);
+    
+    // Reuse the previous frame where it saw the same surface, except for a
+    // rotating subset of pixels that is always re-traced to refresh shading
+    // and hide reprojection errors
+    if (temporalEnabled != 0) {
+        uint slot = pcgHash(uint(pixel.x) ^ pcgHash(uint(pixel.y))) + uint(temporalFrame);
+        ivec2 previousPixel;
+        if (slot % uint(temporalRefreshPeriod) != 0u && reprojectPixel(ray, pixel, previousPixel)) {
+            FragColor = vec4(texelFetch(previousColor, previousPixel, 0).rgb, 1.0);
+            PrimaryHit = texelFetch(previousHit, previousPixel, 0);
+            return;
+        }
+    }
     
     // Trace the ray and get the color
-    vec3 color = traceScene(ray);
-    
-    // Apply gamma correction and output final color
-    color = pow(color, vec3(1.0/2.2)); // Gamma correction
+    vec3 color = traceScene(ray, PrimaryHit);
+    
+    // Running averages with the previous samples of this pixel, which may have
+    // fewer than sampleIndex when adaptive sampling skipped it. Output is
+    // linear, the present pass applies gamma correction.
+    float weight = 1.0 / (moments.z + 1.0);
+    float luminance = dot(color, vec3(0.299, 0.587, 0.114));
+    Moments = vec4(mix(moments.xy, vec2(luminance, luminance * luminance), weight), moments.z + 1.0, 0.0);
+    if (sampleIndex > 0) {
+        vec3 history = texelFetch(historyTexture, pixel, 0).rgb;
+        color = mix(history, color, weight);
+    }
     FragColor = vec4(color, 1.0);
 }
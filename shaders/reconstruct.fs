@@ -0,0 +1,57 @@
+#version 330 core
+out vec4 FragColor;
+
+in vec2 TexCoords;
+
+// Interlaced ray tracing traces one phase of the pixels per frame into
+// samplesTexture (see interlacePhase in raytrace.fs); the other pixels still
+// hold samples from earlier frames. Alpha is 0 for pixels never traced.
+uniform sampler2D samplesTexture;
+uniform int phaseCount;      // 2 = checkerboard, 4 = one pixel of each 2x2 block
+uniform int currentPhase;
+uniform int validPhases;     // bit p is set when phase p was traced since the last change
+
+int phaseOf(ivec2 pixel)
+{
+    return phaseCount == 2 ? ((pixel.x + pixel.y) & 1) : ((pixel.x & 1) + 2 * (pixel.y & 1));
+}
+
+void main()
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    ivec2 maxPixel = textureSize(samplesTexture, 0) - 1;
+    vec4 stored = texelFetch(samplesTexture, pixel, 0);
+
+    // Samples traced this frame or since the last change are exact
+    int phase = phaseOf(pixel);
+    if (phase == currentPhase || (validPhases & (1 << phase)) != 0) {
+        FragColor = vec4(stored.rgb, 1.0);
+        return;
+    }
+
+    // Range of this frame's samples around the pixel
+    vec3 lo = vec3(1e30);
+    vec3 hi = vec3(-1e30);
+    vec3 sum = vec3(0.0);
+    int count = 0;
+    for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+            ivec2 neighbor = clamp(pixel + ivec2(dx, dy), ivec2(0), maxPixel);
+            if (phaseOf(neighbor) != currentPhase) continue;
+            vec3 color = texelFetch(samplesTexture, neighbor, 0).rgb;
+            lo = min(lo, color);
+            hi = max(hi, color);
+            sum += color;
+            count++;
+        }
+    }
+    if (count == 0) {
+        FragColor = vec4(stored.rgb, 1.0);
+        return;
+    }
+
+    // Outdated samples are clamped to the current neighborhood, which keeps
+    // detail where the image did not change and removes ghosts where it did
+    vec3 color = stored.a > 0.0 ? clamp(stored.rgb, lo, hi) : sum / float(count);
+    FragColor = vec4(color, 1.0);
+}
@@ -0,0 +1,627 @@
+// Scene description and intersection code shared by the fragment ray tracer
+// (raytrace.fs) and the compute wavefront stages (wavefront.comp). Included
+// after the #version line and the specialization #defines.
+
+// Camera ray generation basis computed on the host (std140, see CameraBlockData).
+// The direction through window pixel p is rayBase + p.x * pixelDeltaX + p.y * pixelDeltaY.
+layout(std140) uniform CameraBlock {
+    vec3 cameraPosition;
+    vec3 rayBase;        // direction through window coordinate (0, 0)
+    vec3 pixelDeltaX;    // change of direction per pixel to the right
+    vec3 pixelDeltaY;    // change of direction per pixel upwards
+    vec2 screenSize;
+};
+
+// Ray tracing settings (std140, mirrored by SettingsBlockData on the host)
+layout(std140) uniform SettingsBlock {
+    float reflectivity;
+    int shadowsEnabled;
+    int reflectionsEnabled;
+    int bounceLimit;
+    int softShadows;         // sample points on the light spheres instead of their centers
+    int shadowMapLights;     // lights below this index have shadow maps for primary hits
+    int hybridPrimary;       // primary hits come from the rasterized G-buffer
+    float roughness;         // spread of glossy reflections, 0 for mirrors
+};
+
+// Settings that specialized programs receive as #defines from the host (see
+// CompileRayTraceShaders). The generic program reads them from the blocks.
+#ifndef ENABLE_SHADOWS
+#define ENABLE_SHADOWS (shadowsEnabled != 0)
+#endif
+#ifndef ENABLE_REFLECTIONS
+#define ENABLE_REFLECTIONS (reflectionsEnabled != 0)
+#endif
+#ifndef MAX_BOUNCES
+#define MAX_BOUNCES bounceLimit
+#endif
+
+// Scene primitives. Each type lives in its own tightly packed arrays, one
+// vec4 per attribute, and is traversed by its own loop, so no loop branches
+// on a type and the materials are only read for the closest hit.
+#define MAX_SPHERES 16
+#define MAX_BOXES 16
+#define MAX_MESH_INSTANCES 4
+#define PRIMITIVE_SPHERE 0
+#define PRIMITIVE_BOX 1
+#define PRIMITIVE_MESH 2
+
+// Every type is uploaded sorted front to back, so the closest hit found early
+// clips the ray interval for the remaining primitives. Meshes are tested last.
+layout(std140) uniform SceneBlock {
+    vec4 sphereGeometry[MAX_SPHERES];         // xyz = center, w = radius
+    vec4 sphereMaterial[MAX_SPHERES];         // rgb = color, a = reflectivity
+    vec4 boxMin[MAX_BOXES];                   // world-space corners of the boxes
+    vec4 boxMax[MAX_BOXES];
+    vec4 boxMaterial[MAX_BOXES];
+    vec4 meshOffset[MAX_MESH_INSTANCES];      // xyz = translation of the shared mesh
+    vec4 meshBoundsMin[MAX_MESH_INSTANCES];   // world-space bounding box
+    vec4 meshBoundsMax[MAX_MESH_INSTANCES];
+    vec4 meshMaterial[MAX_MESH_INSTANCES];
+    int sphereCount;
+    int boxCount;
+    int meshInstanceCount;
+    int numTriangles;
+    int meshTextureSize;
+};
+#ifndef NUM_SPHERES
+#define NUM_SPHERES sphereCount
+#endif
+#ifndef NUM_BOXES
+#define NUM_BOXES boxCount
+#endif
+#ifndef NUM_MESH_INSTANCES
+#define NUM_MESH_INSTANCES meshInstanceCount
+#endif
+
+// Primitive ids identify a primitive across all types, as stored in the
+// G-buffer: type * PRIMITIVES_PER_TYPE + index
+#define PRIMITIVES_PER_TYPE 16
+
+// Color and reflectivity of primitive index of the given type
+vec4 primitiveMaterial(int type, int index) {
+    if (type == PRIMITIVE_SPHERE) return sphereMaterial[index];
+    if (type == PRIMITIVE_BOX) return boxMaterial[index];
+    return meshMaterial[index];
+}
+
+// Mesh data stored in texture
+uniform sampler2D meshDataTexture;
+
+// Light properties
+struct Light {
+    vec3 position;
+    float intensity;
+    vec3 color;
+    float radius;      // radius of the spherical light used for soft shadows
+    float range;       // distance at which the light fades out, 0 for unbounded
+};
+
+// Lights live in texture buffers so their number is not limited by the block
+// size. lightData holds three texels per light (position and intensity, color
+// and radius, range), lightTree the hierarchy used to pick lights by
+// importance, three texels per node (see LightTreeNode on the host).
+uniform samplerBuffer lightData;
+uniform samplerBuffer lightTree;
+
+// Lights binned into screen tiles and view depth slices (see
+// BuildLightClusters): an (offset, count) pair per cluster followed by the
+// light lists
+uniform isamplerBuffer lightClusters;
+
+layout(std140) uniform LightBlock {
+    vec3 ambientLight;
+    int lightCount;
+    int lightSamples;  // shadow rays per hit when there are more lights than that
+    int lightCulling;  // primary hits shade only the lights of their cluster
+    int clusterTileSize;
+    int clusterSlices;
+    int clusterTilesX;
+    int clusterTilesY;
+    float clusterNear;
+    float clusterFar;
+};
+#ifndef LIGHT_RAYS
+#define LIGHT_RAYS min(lightCount, lightSamples)
+#endif
+
+Light fetchLight(int i) {
+    vec4 texel0 = texelFetch(lightData, i * 3);
+    vec4 texel1 = texelFetch(lightData, i * 3 + 1);
+    Light light;
+    light.position = texel0.xyz;
+    light.intensity = texel0.w;
+    light.color = texel1.rgb;
+    light.radius = texel1.w;
+    light.range = texelFetch(lightData, i * 3 + 2).x;
+    return light;
+}
+
+// Smooth falloff that reaches zero at the light's range
+float lightAttenuation(Light light, float distance) {
+    if (light.range <= 0.0) return 1.0;
+    float x = distance / light.range;
+    float window = clamp(1.0 - x * x * x * x, 0.0, 1.0);
+    return window * window;
+}
+
+// Offset and length of the light list of the cluster containing a point seen
+// through window pixel `pixel`. The view depth is measured along the ray
+// through the screen center, the slices use the same mapping as LightClusterSlice.
+ivec2 lightClusterRange(ivec2 pixel, vec3 position) {
+    vec3 forward = normalize(rayBase + 0.5 * screenSize.x * pixelDeltaX + 0.5 * screenSize.y * pixelDeltaY);
+    float depth = max(dot(position - cameraPosition, forward), 1e-4);
+    int slice = clamp(int(floor(log(depth / clusterNear) / log(clusterFar / clusterNear) * float(clusterSlices))),
+                      0, clusterSlices - 1);
+    ivec2 tile = min(pixel / clusterTileSize, ivec2(clusterTilesX, clusterTilesY) - 1);
+    int cluster = (slice * clusterTilesY + tile.y) * clusterTilesX + tile.x;
+    return ivec2(texelFetch(lightClusters, cluster * 2).r, texelFetch(lightClusters, cluster * 2 + 1).r);
+}
+
+// Omnidirectional shadow maps rasterized by the host (see UpdateShadowMaps):
+// six layers per light holding the distance to the closest surface, rendered
+// with shadowFaceMatrices from the light's position
+uniform sampler2DArray shadowMaps;
+uniform mat4 shadowFaceMatrices[6];   // +X, -X, +Y, -Y, +Z, -Z
+
+// Visibility of light `light` from a surface point according to its shadow
+// map. The point is pushed along the normal to avoid self-shadowing.
+bool shadowMapOccluded(int light, vec3 lightPosition, vec3 point, vec3 normal) {
+    vec3 toPoint = point + 0.03 * normal - lightPosition;
+    vec3 axis = abs(toPoint);
+    int face;
+    if (axis.x >= axis.y && axis.x >= axis.z) {
+        face = toPoint.x > 0.0 ? 0 : 1;
+    } else if (axis.y >= axis.z) {
+        face = toPoint.y > 0.0 ? 2 : 3;
+    } else {
+        face = toPoint.z > 0.0 ? 4 : 5;
+    }
+    vec4 clip = shadowFaceMatrices[face] * vec4(toPoint, 1.0);
+    vec2 uv = clip.xy / clip.w * 0.5 + 0.5;
+    float closest = texture(shadowMaps, vec3(uv, float(light * 6 + face))).r;
+    return closest + 0.02 < length(toPoint);
+}
+
+// Random number generator state (PCG hash), seeded per pixel and sample
+uint rngState = 0u;
+
+uint pcgHash(uint v) {
+    uint state = v * 747796405u + 2891336453u;
+    uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+float random01() {
+    rngState = pcgHash(rngState);
+    return float(rngState) * (1.0 / 4294967296.0);
+}
+
+vec3 randomUnitVector() {
+    float z = random01() * 2.0 - 1.0;
+    float phi = random01() * 6.28318530718;
+    float r = sqrt(max(0.0, 1.0 - z * z));
+    return vec3(r * cos(phi), r * sin(phi), z);
+}
+
+// Direction of a reflection ray; glossy surfaces perturb the mirror direction
+// randomly, keeping it above the surface
+vec3 reflectionDirection(vec3 incoming, vec3 normal) {
+    vec3 direction = reflect(incoming, normal);
+    if (roughness > 0.0) {
+        direction = normalize(direction + roughness * randomUnitVector());
+        if (dot(direction, normal) < 0.0) {
+            direction = reflect(direction, normal);
+        }
+    }
+    return direction;
+}
+
+// Ray structure
+struct Ray {
+    vec3 origin;
+    vec3 direction;
+};
+
+// Triangle structure for Möller-Trumbore algorithm
+struct Triangle {
+    vec3 v0;
+    vec3 v1;
+    vec3 v2;
+    vec3 normal;
+};
+
+// Hit information
+struct HitInfo {
+    bool hit;
+    float t;
+    vec3 position;
+    vec3 normal;
+    vec3 color;
+    float reflectivity;
+};
+
+// Function to fetch triangle data from texture
+Triangle getTriangleFromTexture(int triangleIndex) {
+    Triangle tri;
+    
+    // Each triangle uses 3 texels (12 floats total)
+    // Texture width is 4 texels, so each row is one triangle
+    int textureWidth = 4;
+    
+    // Calculate texture coordinates
+    int row = triangleIndex;
+    
+    // Read vertex 0 (first texel, xyz)
+    vec4 texel0 = texelFetch(meshDataTexture, ivec2(0, row), 0);
+    tri.v0 = texel0.xyz;
+    
+    // Read vertex 1 (first texel w component + second texel xy)
+    vec4 texel1 = texelFetch(meshDataTexture, ivec2(1, row), 0);
+    tri.v1 = vec3(texel0.w, texel1.xy);
+    
+    // Read vertex 2 (second texel zw + third texel x)
+    vec4 texel2 = texelFetch(meshDataTexture, ivec2(2, row), 0);
+    tri.v2 = vec3(texel1.zw, texel2.x);
+    
+    // Read normal (third texel yzw)
+    tri.normal = vec3(texel2.yzw);
+    
+    return tri;
+}
+
+// Ray-AABB interval test: does the ray enter the box before tMax?
+bool intersectBounds(Ray ray, vec3 boundsMin, vec3 boundsMax, float tMax) {
+    vec3 invDir = 1.0 / ray.direction;
+    vec3 t0 = (boundsMin - ray.origin) * invDir;
+    vec3 t1 = (boundsMax - ray.origin) * invDir;
+    vec3 tSmall = min(t0, t1);
+    vec3 tBig = max(t0, t1);
+    float tNear = max(max(tSmall.x, tSmall.y), tSmall.z);
+    float tFar = min(min(tBig.x, tBig.y), tBig.z);
+    return tNear <= tFar && tFar > 0.001 && tNear < tMax;
+}
+
+// Ray-Sphere intersection, returns the distance of the first hit closer than
+// tMax or -1 on a miss
+float sphereDistance(Ray ray, vec4 sphere, float tMax) {
+    vec3 oc = ray.origin - sphere.xyz;
+    float a = dot(ray.direction, ray.direction);
+    float b = 2.0 * dot(oc, ray.direction);
+    float c = dot(oc, oc) - sphere.w * sphere.w;
+    float discriminant = b * b - 4.0 * a * c;
+    
+    if (discriminant < 0.0) {
+        return -1.0;
+    }
+    
+    float sqrtD = sqrt(discriminant);
+    float t = (-b - sqrtD) / (2.0 * a);
+    if (t < 0.001) {
+        t = (-b + sqrtD) / (2.0 * a);
+    }
+    return t >= 0.001 && t < tMax ? t : -1.0;
+}
+
+// Ray-AABB (box) intersection, returns the distance of the first hit closer
+// than tMax or -1 on a miss
+float boxDistance(Ray ray, vec3 boundsMin, vec3 boundsMax, float tMax) {
+    vec3 t0 = (boundsMin - ray.origin) / ray.direction;
+    vec3 t1 = (boundsMax - ray.origin) / ray.direction;
+    vec3 tSmall = min(t0, t1);
+    vec3 tBig = max(t0, t1);
+    
+    float tNear = max(max(tSmall.x, tSmall.y), tSmall.z);
+    float tFar = min(min(tBig.x, tBig.y), tBig.z);
+    
+    if (tNear > tFar || tFar < 0.001) {
+        return -1.0;
+    }
+    
+    float t = tNear > 0.001 ? tNear : tFar;
+    return t < tMax ? t : -1.0;
+}
+
+// Normal of the box face that contains position, based on which axis the
+// offset from the center is largest along
+vec3 boxNormal(vec3 position, vec3 boundsMin, vec3 boundsMax) {
+    vec3 pc = position - 0.5 * (boundsMin + boundsMax);
+    vec3 absPC = abs(pc);
+    
+    if (absPC.x > absPC.y && absPC.x > absPC.z) {
+        return vec3(sign(pc.x), 0.0, 0.0);
+    } else if (absPC.y > absPC.z) {
+        return vec3(0.0, sign(pc.y), 0.0);
+    }
+    return vec3(0.0, 0.0, sign(pc.z));
+}
+
+// Ray-Triangle intersection using Möller-Trumbore algorithm
+bool intersectTriangle(Ray ray, Triangle triangle, float tMax, out HitInfo hitInfo) {
+    const float EPSILON = 0.0000001;
+    
+    vec3 edge1 = triangle.v1 - triangle.v0;
+    vec3 edge2 = triangle.v2 - triangle.v0;
+    vec3 h = cross(ray.direction, edge2);
+    float a = dot(edge1, h);
+    
+    if (abs(a) < EPSILON)
+        return false;    // Ray is parallel to triangle
+    
+    float f = 1.0 / a;
+    vec3 s = ray.origin - triangle.v0;
+    float u = f * dot(s, h);
+    
+    if (u < 0.0 || u > 1.0)
+        return false;
+    
+    vec3 q = cross(s, edge1);
+    float v = f * dot(ray.direction, q);
+    
+    if (v < 0.0 || u + v > 1.0)
+        return false;
+    
+    // At this stage, we can compute t to find out where the intersection point is on the line
+    float t = f * dot(edge2, q);
+    
+    if (t > EPSILON && t < tMax) {
+        hitInfo.hit = true;
+        hitInfo.t = t;
+        hitInfo.position = ray.origin + ray.direction * t;
+        
+        // Calculate the normal
+        if (length(triangle.normal) > 0.0) {
+            // Use the pre-computed normal if available
+            hitInfo.normal = normalize(triangle.normal);
+        } else {
+            // Calculate normal from vertices
+            hitInfo.normal = normalize(cross(edge1, edge2));
+        }
+        
+        // Ensure normal faces the right direction
+        if (dot(ray.direction, hitInfo.normal) > 0.0) {
+            hitInfo.normal = -hitInfo.normal;
+        }
+        
+        return true;
+    }
+    
+    return false;
+}
+
+// Ray-Mesh intersection with mesh instance i. On a hit closer than tMax, tMax
+// is lowered to its distance and normal is set.
+bool intersectMesh(Ray ray, int instance, inout float tMax, out vec3 normal) {
+    normal = vec3(0.0);
+    
+    // Skip the triangle loop when the ray misses the instance bounds
+    if (!intersectBounds(ray, meshBoundsMin[instance].xyz, meshBoundsMax[instance].xyz, tMax)) {
+        return false;
+    }
+    
+    // The instances share the mesh triangles, which are stored in object space
+    Ray localRay;
+    localRay.origin = ray.origin - meshOffset[instance].xyz;
+    localRay.direction = ray.direction;
+    
+    bool hit = false;
+    for (int i = 0; i < numTriangles; i++) {
+        HitInfo triangleHit;
+        if (intersectTriangle(localRay, getTriangleFromTexture(i), tMax, triangleHit)) {
+            tMax = triangleHit.t;
+            normal = triangleHit.normal;
+            hit = true;
+        }
+    }
+    
+    return hit;
+}
+
+// Get the closest hit among all primitives. The loops only track the closest
+// distance; position, normal and material are computed once for the winner.
+bool traceRay(Ray ray, out HitInfo hitInfo) {
+    float tClosest = 1e30; // Large number
+    int hitType = -1;
+    int hitIndex = 0;
+    vec3 meshNormal = vec3(0.0);
+    
+    // The current closest hit is the upper bound for every later primitive
+    for (int i = 0; i < NUM_SPHERES; i++) {
+        float t = sphereDistance(ray, sphereGeometry[i], tClosest);
+        if (t >= 0.0) {
+            tClosest = t;
+            hitType = PRIMITIVE_SPHERE;
+            hitIndex = i;
+        }
+    }
+    
+    for (int i = 0; i < NUM_BOXES; i++) {
+        float t = boxDistance(ray, boxMin[i].xyz, boxMax[i].xyz, tClosest);
+        if (t >= 0.0) {
+            tClosest = t;
+            hitType = PRIMITIVE_BOX;
+            hitIndex = i;
+        }
+    }
+    
+    for (int i = 0; i < NUM_MESH_INSTANCES; i++) {
+        vec3 normal;
+        if (intersectMesh(ray, i, tClosest, normal)) {
+            meshNormal = normal;
+            hitType = PRIMITIVE_MESH;
+            hitIndex = i;
+        }
+    }
+    
+    hitInfo.hit = hitType >= 0;
+    hitInfo.t = tClosest;
+    if (!hitInfo.hit) {
+        return false;
+    }
+    
+    hitInfo.position = ray.origin + tClosest * ray.direction;
+    if (hitType == PRIMITIVE_SPHERE) {
+        hitInfo.normal = normalize(hitInfo.position - sphereGeometry[hitIndex].xyz);
+    } else if (hitType == PRIMITIVE_BOX) {
+        hitInfo.normal = boxNormal(hitInfo.position, boxMin[hitIndex].xyz, boxMax[hitIndex].xyz);
+    } else {
+        hitInfo.normal = meshNormal;
+    }
+    
+    vec4 material = primitiveMaterial(hitType, hitIndex);
+    hitInfo.color = material.rgb;
+    hitInfo.reflectivity = material.a;
+    return true;
+}
+
+// Any-hit tests for shadow rays: they only report whether some intersection
+// lies closer than tMax. Spheres and boxes use their distance functions,
+// which compute no hit record.
+
+// Ray-Triangle occlusion (Möller-Trumbore without the hit record)
+bool occludesTriangle(Ray ray, Triangle triangle, float tMax) {
+    const float EPSILON = 0.0000001;
+    
+    vec3 edge1 = triangle.v1 - triangle.v0;
+    vec3 edge2 = triangle.v2 - triangle.v0;
+    vec3 h = cross(ray.direction, edge2);
+    float a = dot(edge1, h);
+    
+    if (abs(a) < EPSILON)
+        return false;
+    
+    float f = 1.0 / a;
+    vec3 s = ray.origin - triangle.v0;
+    float u = f * dot(s, h);
+    
+    if (u < 0.0 || u > 1.0)
+        return false;
+    
+    vec3 q = cross(s, edge1);
+    float v = f * dot(ray.direction, q);
+    
+    if (v < 0.0 || u + v > 1.0)
+        return false;
+    
+    float t = f * dot(edge2, q);
+    return t > EPSILON && t < tMax;
+}
+
+// Ray-Mesh occlusion with mesh instance i, stops at the first blocking triangle
+bool occludesMesh(Ray ray, int instance, float tMax) {
+    if (!intersectBounds(ray, meshBoundsMin[instance].xyz, meshBoundsMax[instance].xyz, tMax)) {
+        return false;
+    }
+    
+    Ray localRay;
+    localRay.origin = ray.origin - meshOffset[instance].xyz;
+    localRay.direction = ray.direction;
+    
+    for (int i = 0; i < numTriangles; i++) {
+        if (occludesTriangle(localRay, getTriangleFromTexture(i), tMax)) {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+// Returns true as soon as any primitive blocks the ray before tMax
+bool isOccluded(Ray ray, float tMax) {
+    for (int i = 0; i < NUM_SPHERES; i++) {
+        if (sphereDistance(ray, sphereGeometry[i], tMax) >= 0.0) {
+            return true;
+        }
+    }
+    
+    for (int i = 0; i < NUM_BOXES; i++) {
+        if (boxDistance(ray, boxMin[i].xyz, boxMax[i].xyz, tMax) >= 0.0) {
+            return true;
+        }
+    }
+    
+    for (int i = 0; i < NUM_MESH_INSTANCES; i++) {
+        if (occludesMesh(ray, i, tMax)) {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+// Check if a point is in shadow
+bool isInShadow(vec3 point, vec3 lightPosition) {
+    vec3 lightDir = normalize(lightPosition - point);
+    float lightDistance = length(lightPosition - point);
+    
+    Ray shadowRay;
+    shadowRay.origin = point + 0.001 * lightDir; // Offset to avoid self-shadowing
+    shadowRay.direction = lightDir;
+    
+    return isOccluded(shadowRay, lightDistance);
+}
+
+// Unshadowed Blinn-Phong contribution of a light at a hit, lightDir points
+// from the hit towards the light
+vec3 shadeLight(HitInfo hitInfo, Light light, vec3 lightDir) {
+    float diffFactor = max(dot(lightDir, hitInfo.normal), 0.0);
+    vec3 diffuse = diffFactor * light.color * light.intensity * hitInfo.color;
+    
+    vec3 viewDir = normalize(cameraPosition - hitInfo.position);
+    vec3 halfwayDir = normalize(lightDir + viewDir);
+    float spec = pow(max(dot(hitInfo.normal, halfwayDir), 0.0), 32.0);
+    vec3 specular = spec * light.color * light.intensity * 0.5;
+    
+    return (diffuse + specular) * lightAttenuation(light, distance(light.position, hitInfo.position));
+}
+
+// Importance of a light tree node for a shading position: its summed energy
+// times the largest lightAttenuation any of its lights can have there, taken at
+// the distance to the node's bounds and its largest range. Nodes that are out
+// of range of the position get no importance.
+float lightNodeImportance(int node, vec3 position) {
+    vec4 texel0 = texelFetch(lightTree, node * 3);
+    vec4 texel1 = texelFetch(lightTree, node * 3 + 1);
+    if (texel1.w <= 0.0) return texel0.w;
+    vec3 offset = max(max(texel0.xyz - position, position - texel1.xyz), vec3(0.0));
+    float x = length(offset) / texel1.w;
+    float window = clamp(1.0 - x * x * x * x, 0.0, 1.0);
+    return texel0.w * window * window;
+}
+
+// Light for shadow ray `ray` of a hit at position, and the weight of its
+// contribution. With no more lights than rays each light gets one ray of
+// weight 1. Otherwise the tree is descended choosing children in proportion to
+// their importance, and the weight is 1 / (probability * rays).
+int selectLight(int ray, vec3 position, out float weight) {
+    weight = 1.0;
+    if (lightCount <= lightSamples) {
+        return ray;
+    }
+    
+    int node = 0;
+    float probability = 1.0;
+    for (int depth = 0; depth < 64; depth++) {
+        vec4 links = texelFetch(lightTree, node * 3 + 2);   // left, right, light index
+        if (links.z >= 0.0) {
+            weight = 1.0 / (probability * float(lightSamples));
+            return int(links.z);
+        }
+        
+        int left = int(links.x);
+        int right = int(links.y);
+        float importanceLeft = lightNodeImportance(left, position);
+        float importanceRight = lightNodeImportance(right, position);
+        float total = importanceLeft + importanceRight;
+        float probabilityLeft = total > 0.0 ? importanceLeft / total : 0.5;
+        if (random01() < probabilityLeft) {
+            node = left;
+            probability *= probabilityLeft;
+        } else {
+            node = right;
+            probability *= 1.0 - probabilityLeft;
+        }
+    }
+    weight = 0.0;
+    return 0;
+}
@@ -0,0 +1,35 @@
+#version 330 core
+out vec4 FragColor;
+
+in vec2 TexCoords;
+
+// Adaptive sampling mask: one fragment per tile of tileSize x tileSize pixels.
+// A tile stays active (1) while the relative standard error of the mean of any
+// of its pixels is above threshold, and is discarded (left at 0) otherwise.
+uniform sampler2D momentsTexture;   // mean luminance, mean squared luminance, sample count
+uniform int tileSize;
+uniform float threshold;
+
+void main()
+{
+    ivec2 tileOrigin = ivec2(gl_FragCoord.xy) * tileSize;
+    ivec2 size = textureSize(momentsTexture, 0);
+
+    float worstError = 0.0;
+    for (int y = 0; y < tileSize; y++) {
+        for (int x = 0; x < tileSize; x++) {
+            ivec2 pixel = tileOrigin + ivec2(x, y);
+            if (pixel.x >= size.x || pixel.y >= size.y) continue;
+
+            vec4 moments = texelFetch(momentsTexture, pixel, 0);
+            float variance = max(moments.y - moments.x * moments.x, 0.0);
+            float error = sqrt(variance / max(moments.z, 1.0)) / (moments.x + 0.01);
+            worstError = max(worstError, error);
+        }
+    }
+
+    if (worstError < threshold) {
+        discard;
+    }
+    FragColor = vec4(1.0);
+}
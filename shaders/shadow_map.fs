@@ -0,0 +1,10 @@
+#version 330 core
+layout(location = 0) out float Distance;
+
+in vec3 toFragment;
+
+void main()
+{
+    // Distance to the light, compared against in shadowMapOccluded (rt_common.glsl)
+    Distance = length(toFragment);
+}
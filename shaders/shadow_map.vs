@@ -0,0 +1,17 @@
+#version 330 core
+layout(location = 0) in vec3 Position;
+
+// Renders one face of a light's omnidirectional shadow map. The face matrix
+// looks from the origin, so positions are taken relative to the light.
+uniform mat4 gWorld;
+uniform mat4 faceViewProjection;
+uniform vec3 lightPosition;
+
+out vec3 toFragment;   // from the light to the fragment
+
+void main()
+{
+    vec4 worldPos = gWorld * vec4(Position, 1.0);
+    toFragment = worldPos.xyz - lightPosition;
+    gl_Position = faceViewProjection * vec4(toFragment, 1.0);
+}